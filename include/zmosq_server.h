@@ -32,17 +32,207 @@ extern "C" {
 //
 //      zstr_send (zmosq_server, "VERBOSE");
 //
+//  Choose who runs mosquitto network loop, "thread" (default) is a thread
+//  started by mosquitto library, "actor" makes actor poll the mosquitto
+//  socket itself, so there is no extra thread and no hand-off between
+//  threads. "reactor" lets a pool of threads shared by all actors in the
+//  process service the connection, the first actor asking for it sets the
+//  number of threads (default 4). Must be called before START. Reactor
+//  thread never blocks on a slow actor: internal queue has no HWM, a full
+//  RING drops messages, so does a full DIRECT data socket, and LIMIT relay
+//  can't use "block" policy. Dropped messages are counted in DROPPED.
+//
+//      zstr_sendx (zmosq_server, "LOOP", "actor", NULL);
+//      zstr_sendx (zmosq_server, "LOOP", "reactor", "4", NULL);
+//
+//  Pass MQTT messages from mosquitto thread to the actor through lock-free
+//  ring of given size instead of zeromq socket, actor is woken up only
+//  when it has drained the ring and waits for more. Connection events still
+//  come after messages received before them.
+//
+//      zstr_sendx (zmosq_server, "RING", "65536", NULL);
+//
+//  Open given number of MQTT connections instead of one, subscribed topics
+//  are partitioned among them by hash and messages of all of them are
+//  delivered to the one consumer. Order is kept per topic only. Published
+//  messages go out through the connection owning the topic. Must be called
+//  before START.
+//
+//      zstr_sendx (zmosq_server, "SHARDS", "4", NULL);
+//
+//  Deliver MQTT messages on a dedicated data socket instead of the actor
+//  pipe, saving one zeromq hop per message. Replies with the endpoint
+//  the consumer shall connect its PAIR socket to, or empty string after
+//  START, DIRECT must be set before. Network loop sends the messages to
+//  the data socket itself, so nothing the actor does on the way applies:
+//  no LIMIT, CONFLATE, CACHE, ROUTE, PUB, MLM, BATCH nor RING, and STATS
+//  has no delivery latency. INTERN still replaces topics by ids.
+//
+//      zstr_send (zmosq_server, "DIRECT");
+//      char *endpoint = zstr_recv (zmosq_server);
+//      zsock_t *data = zsock_new_pair (endpoint);
+//
+//  Publish MQTT messages as [topic|payload] on a PUB socket bound to the
+//  endpoint instead of the actor pipe, so any number of consumers can
+//  subscribe to topic prefixes. Replies with the bound endpoint, or empty
+//  string on error. Can be repeated to bind more endpoints. Messages are
+//  never batched nor interned, and are dropped for subscribers which are
+//  not keeping up.
+//
+//      zstr_sendx (zmosq_server, "PUB", "tcp://127.0.0.1:*", NULL);
+//      char *endpoint = zstr_recv (zmosq_server);
+//      zsock_t *sub = zsock_new_sub (endpoint, "sensors/");
+//
+//  Forward MQTT messages to malamute stream instead of the actor pipe,
+//  MQTT topic is the subject and payload the content of stream message.
+//  Only when zmosq is built with malamute, which is optional.
+//  With BATCH, payloads of one topic in the batch go in one stream
+//  message, a frame each, in the order they came. Order across topics
+//  is not kept. MLM-CONNECT waits for the malamute broker for given msecs
+//  (default 1000), the actor handles nothing else meanwhile. Messages the
+//  stream does not take are counted in DROPPED as dropped by deliver stage.
+//
+//      zstr_sendx (zmosq_server, "MLM-CONNECT", "ipc://@/malamute", NULL);
+//      zstr_sendx (zmosq_server, "MLM-CONNECT", "ipc://@/malamute", "100", NULL);
+//      zstr_sendx (zmosq_server, "MLM-PUBLISH", "STREAM", NULL);
+//
+//  Deliver MQTT messages in batches [topic|payload|topic|payload|...], a
+//  batch is flushed when it has count messages, or bytes of content, or
+//  when its first message is usecs old. Count 0 switches batching off,
+//  bytes 0 means no size limit. Applied to messages delivered on the
+//  actor pipe and to malamute stream.
+//
+//      zstr_sendx (zmosq_server, "BATCH", "count", "bytes", "usecs", NULL);
+//
+//  Replace topic of delivered messages by 4 bytes id, network byte order,
+//  so consumer can dispatch by array lookup. Every new topic is announced
+//  once before its id is first used, as ["$TOPIC"|id|topic]. Ids start at
+//  0 and are never reused. Must be called before START.
+//
+//      zstr_send (zmosq_server, "INTERN");
+//
+//  Send MQTT messages with topic matching MQTT pattern, with "+" and "#"
+//  wildcards, to PUSH socket connected (or bound, with "@" prefix) to the
+//  endpoint, as [topic|payload]. Message matching several routes goes to
+//  each of them, messages taken by a route are not delivered to the actor.
+//  Route which can't take a message right away drops it. Not applied in
+//  DIRECT mode. Can be repeated, also after START.
+//
+//      zstr_sendx (zmosq_server, "ROUTE", "sensors/+/temp", "ipc://@/temp", NULL);
+//
+//  Limit number of messages and bytes of content queued in a stage of the
+//  message flow, 0 means no limit. Stage "relay" is from mosquitto network
+//  loop to the actor, must be set before START and is not used with LOOP
+//  actor. Stage "deliver" is from the actor to the pipe, its messages wait
+//  in the actor until consumer makes room. When the stage is full, policy
+//  "block" (default) waits, "drop-oldest" drops the oldest queued message
+//  and "drop-newest" the one which does not fit. Network loop blocked on
+//  relay stage can't answer the broker, so it waits for half of keepalive
+//  given to CONNECT at most, then drops the message to keep the session.
+//  Under sustained overload "block" thus drops messages as well, counted
+//  in DROPPED.
+//
+//      zstr_sendx (zmosq_server, "LIMIT", "deliver", "10000", "0", "drop-oldest", NULL);
+//
+//  Cache last payload and time of receive of every topic, to answer new
+//  consumers without waiting for next publish. Not applied in DIRECT mode.
+//
+//      zstr_send (zmosq_server, "CACHE");
+//
+//  Ask for last value of topic, reply comes on the pipe as
+//  ["$VALUE"|topic|received|payload], or ["$VALUE"|topic] if topic has no
+//  value. Received is time in msecs since the epoch.
+//
+//      zstr_sendx (zmosq_server, "GET", "sensors/1/temp", NULL);
+//
+//  Ask for last values of all topics matching MQTT pattern ("#" if not
+//  given), reply comes on the pipe as one message
+//  ["$SNAPSHOT"|topic|received|payload|topic|received|payload|...]
+//
+//      zstr_sendx (zmosq_server, "SNAPSHOT", "sensors/+/temp", NULL);
+//
+//  Keep only the latest message of every topic among messages waiting for
+//  the consumer. Message waiting in the actor is replaced by a newer one on
+//  the same topic, which is queued at the end, so a slow consumer skips
+//  stale values and the actor holds at most one message per topic. Batches
+//  and $TOPIC announcements are never conflated.
+//
+//      zstr_send (zmosq_server, "CONFLATE");
+//
+//  Ask for number of messages dropped by relay and deliver stages and
+//  replaced by CONFLATE, reply comes on the pipe as
+//  ["$DROPPED"|relay|deliver|superseded]
+//
+//      zstr_send (zmosq_server, "DROPPED");
+//
+//  Ask for statistics, reply comes on the pipe as one message
+//  ["$STATS"|name|value|name|value|...] with counters since creation:
+//  received, received_bytes, reconnects, relay_queued, relay_dropped,
+//  deliver_queued, deliver_queued_bytes, deliver_dropped, superseded,
+//  published, published_bytes, publish_failed. Latencies in usecs come as
+//  <name>_count, _p50, _p99, _p999 and _max for delivery_usecs, the time
+//  from network loop callback to the actor handing message over to its
+//  sink (one message per connection is timed at a time, one in 64 with
+//  LOOP actor), and publish_usecs, the time from reading the command to
+//  mosquitto_publish returning for its first message (one command in 64
+//  is timed).
+//  Counters are kept by the thread updating them, without locks.
+//
+//      zstr_send (zmosq_server, "STATS");
+//
 //  Connect to mosquitto broker
 //
 //      zstr_sendx (zmosq_server, "CONNECT", "host", "port", "keepalive", "bind_address", NULL);
 //
-//  Subscribe on MQQT topic (can be repeated, or more topics can be specified here)
+//  Set reconnect backoff in msecs (default 1000 to 30000). Delay doubles
+//  from min up to max while reconnects fail and is randomly shortened by
+//  up to half, so bridges do not hit restarted broker all at once. With
+//  LOOP thread mosquitto library does the backoff in whole seconds and
+//  jitter only applies to the first delay. Must be called before START.
+//
+//      zstr_sendx (zmosq_server, "RECONNECT", "1000", "30000", NULL);
+//
+//  Set largest SUBSCRIBE packet in bytes (default 65536). Topics are
+//  (re)subscribed on connect in as few packets as fit in this size.
+//
+//      zstr_sendx (zmosq_server, "MAX-PACKET", "131072", NULL);
+//
+//  Subscribe on MQQT topic (can be repeated, or more topics can be specified here).
+//  SUBSCRIBE uses QoS 0, SUBSCRIBE-QOS takes strict pairs of topic and QoS
+//  "0", "1" or "2", and refuses the whole command otherwise. Subscribing
+//  known topic again changes its QoS. After START the
+//  change is applied to the running session right away, changes made by
+//  commands which come in a burst are sent in shared packets, no later than
+//  10 msecs after the first change.
 //
 //      zstr_sendx (zmosq_server, "SUBSCRIBE", "<TOPIC_1>", ..., "<TOPIC_N>", NULL);
+//      zstr_sendx (zmosq_server, "SUBSCRIBE-QOS", "control/#", "1", "telemetry/#", "0", NULL);
+//
+//  Unsubscribe from MQTT topics, also applied to the running session
+//
+//      zstr_sendx (zmosq_server, "UNSUBSCRIBE", "<TOPIC_1>", ..., "<TOPIC_N>", NULL);
+//
+//  Ask for subscribed topics, reply comes on the pipe as
+//  ["$SUBSCRIPTIONS"|topic|qos|granted|...] with QoS asked for and QoS
+//  granted by broker, -1 until broker acknowledged it, 128 if refused
+//
+//      zstr_send (zmosq_server, "SUBSCRIPTIONS");
 //
 //  Start zmosq_server actor - all broker related commands must be called before!
+//  With timeout in msecs, actor replies ["$STARTED"|"OK"] once every
+//  connection is up and its subscriptions are acknowledged by broker, or
+//  ["$STARTED"|"TIMEOUT"] when that does not happen in time
 //
 //      zstr_sendx (zmosq_server, "START", NULL);
+//      zstr_sendx (zmosq_server, "START", "5000", NULL);
+//
+//  Forward connection events to the pipe, as they happen
+//  ["$CONNECTED"|shard|packets]        connection is up, subscribing topics
+//  ["$SUBACK"|shard|mid|topic|granted|...]  broker acknowledged subscription
+//  ["$UNSUBACK"|shard|mid|topic|...]   broker acknowledged unsubscription
+//  ["$DISCONNECTED"|shard|code]        connection lost or refused by broker
+//
+//      zstr_send (zmosq_server, "EVENTS");
 //
 //  Stop zmosq_server actor.
 //
@@ -58,6 +248,47 @@ extern "C" {
 //
 //      zstr_sendx (zmosq_pub, "PUBLISH", "TOPIC", "0", "false", "HELLO, FRAME", NULL);
 //
+//  Many MQQT messages can be published at once, one actor wake-up for all
+//  [topic|qos|retain|payload|topic|qos|retain|payload|...]
+//
+//      zmsg_t *msg = zmsg_new ();
+//      zmsg_addstr (msg, "PUBLISH-MANY");
+//      zmsg_addstr (msg, "TOPIC"); zmsg_addstr (msg, "0");
+//      zmsg_addstr (msg, "false"); zmsg_addstr (msg, "HELLO, FRAME");
+//      ...
+//      zmsg_send (&msg, zmosq_pub);
+//
+//  Bind PULL (default) or SUB socket, any number of producers can then
+//  publish to MQTT by sending [topic|qos|retain|payload] records to it,
+//  one or more per message, without going through the actor pipe. Replies
+//  with the bound endpoint, or empty string on error. Can be repeated to
+//  bind more endpoints.
+//
+//      zstr_sendx (zmosq_pub, "INGRESS", "ipc://@/mqtt-out", "pull", NULL);
+//      char *endpoint = zstr_recv (zmosq_pub);
+//
+//  Commands on hot paths can be sent binary encoded instead, as one or more
+//  [header|body] pairs in one message. Header is ZMOSQ_SERVER_HEADER_SIZE
+//  bytes
+//
+//      byte 0      0, tells binary command from string one
+//      byte 1      opcode, ZMOSQ_SERVER_OP_*
+//      byte 2      flags, qos 0-2 (ZMOSQ_SERVER_FLAG_QOS), ZMOSQ_SERVER_FLAG_RETAIN
+//      byte 3      reserved, 0
+//      bytes 4-7   size of topic, network byte order
+//
+//  and body is the topic immediately followed by the payload. Malformed pair
+//  is logged and stops processing of the rest of the message.
+//
+//      zmsg_t *msg = zmsg_new ();
+//      zmosq_server_publish_append (msg, "TOPIC", 0, false, "HELLO", 5);
+//      zmsg_send (&msg, zmosq_pub);
+//
+#define ZMOSQ_SERVER_HEADER_SIZE    8
+#define ZMOSQ_SERVER_OP_PUBLISH     1
+#define ZMOSQ_SERVER_FLAG_QOS       0x03
+#define ZMOSQ_SERVER_FLAG_RETAIN    0x04
+
 //  This is the zmosq_server constructor as a zactor_fn;
 ZMSQ_EXPORT void
     zmosq_server_actor (zsock_t *pipe, void *args);
@@ -65,6 +296,31 @@ ZMSQ_EXPORT void
 //  Self test of this actor
 ZMSQ_EXPORT void
     zmosq_server_test (bool verbose);
+
+#ifdef ZMSQ_BUILD_DRAFT_API
+//  *** Draft method, for development use, may change without warning ***
+//  Append binary PUBLISH command to msg. Return 0 if OK, else -1, also when
+//  qos is not 0, 1 or 2.
+ZMSQ_EXPORT int
+    zmosq_server_publish_append (zmsg_t *msg, const char *topic, int qos, bool retain, const void *payload, size_t size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Benchmark seam: feed count synthetic MQTT messages with payload of size
+//  bytes to the on_message callback and relay them through the actor to the
+//  consumer, all in the calling thread and without broker. Mode is "thread",
+//  "ring", "actor" or "direct". Return nsecs per message, -1 if mode is not
+//  known.
+ZMSQ_EXPORT double
+    zmosq_server_bench_deliver (const char *mode, size_t count, size_t size);
+
+//  *** Draft method, for development use, may change without warning ***
+//  Benchmark seam: let the actor handle count PUBLISH commands with payload
+//  of size bytes, binary or string ones, without broker. Return nsecs per
+//  command.
+ZMSQ_EXPORT double
+    zmosq_server_bench_publish (bool binary, size_t count, size_t size);
+
+#endif // ZMSQ_BUILD_DRAFT_API
 //  @end
 
 #ifdef __cplusplus
@@ -0,0 +1,147 @@
+/*  =========================================================================
+    zmosq_atomic - Atomic operations on counters shared by threads
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.
+    This file is part of the Malamute Project.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef ZMOSQ_ATOMIC_H_INCLUDED
+#define ZMOSQ_ATOMIC_H_INCLUDED
+
+//  Operations on size_t values with C11 memory orders, and count of leading
+//  zero bits, mapped to GCC and Clang builtins, or to MSVC intrinsics
+
+#if defined (__GNUC__) || defined (__clang__)
+#   define ZMOSQ_RELAXED    __ATOMIC_RELAXED
+#   define ZMOSQ_ACQUIRE    __ATOMIC_ACQUIRE
+#   define ZMOSQ_RELEASE    __ATOMIC_RELEASE
+
+static inline size_t
+zmosq_atomic_load (size_t *ptr, int order)
+{
+    return __atomic_load_n (ptr, order);
+}
+
+static inline void
+zmosq_atomic_store (size_t *ptr, size_t value, int order)
+{
+    __atomic_store_n (ptr, value, order);
+}
+
+//  Set value, return the previous one, acquire and release
+static inline size_t
+zmosq_atomic_exchange (size_t *ptr, size_t value)
+{
+    return __atomic_exchange_n (ptr, value, __ATOMIC_ACQ_REL);
+}
+
+//  Add to value, return the previous one, relaxed
+static inline size_t
+zmosq_atomic_fetch_add (size_t *ptr, size_t value)
+{
+    return __atomic_fetch_add (ptr, value, __ATOMIC_RELAXED);
+}
+
+//  Subtract from value, return the previous one, relaxed
+static inline size_t
+zmosq_atomic_fetch_sub (size_t *ptr, size_t value)
+{
+    return __atomic_fetch_sub (ptr, value, __ATOMIC_RELAXED);
+}
+
+//  Full memory barrier
+static inline void
+zmosq_atomic_fence (void)
+{
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+}
+
+//  Number of leading zero bits of value, which must not be 0
+static inline int
+zmosq_clz64 (uint64_t value)
+{
+    return __builtin_clzll (value);
+}
+
+#elif defined (_MSC_VER)
+#   include <intrin.h>
+//  Aligned loads and stores are atomic, and on x86 and x64 they are also
+//  acquire and release, so only the compiler must not reorder them
+#   define ZMOSQ_RELAXED    0
+#   define ZMOSQ_ACQUIRE    2
+#   define ZMOSQ_RELEASE    3
+
+static __inline size_t
+zmosq_atomic_load (size_t *ptr, int order)
+{
+    size_t value = *(volatile size_t *) ptr;
+    _ReadWriteBarrier ();
+    return value;
+}
+
+static __inline void
+zmosq_atomic_store (size_t *ptr, size_t value, int order)
+{
+    _ReadWriteBarrier ();
+    *(volatile size_t *) ptr = value;
+}
+
+static __inline size_t
+zmosq_atomic_exchange (size_t *ptr, size_t value)
+{
+#   if defined (_WIN64)
+    return (size_t) _InterlockedExchange64 ((volatile __int64 *) ptr, (__int64) value);
+#   else
+    return (size_t) _InterlockedExchange ((volatile long *) ptr, (long) value);
+#   endif
+}
+
+static __inline size_t
+zmosq_atomic_fetch_add (size_t *ptr, size_t value)
+{
+#   if defined (_WIN64)
+    return (size_t) _InterlockedExchangeAdd64 ((volatile __int64 *) ptr, (__int64) value);
+#   else
+    return (size_t) _InterlockedExchangeAdd ((volatile long *) ptr, (long) value);
+#   endif
+}
+
+static __inline size_t
+zmosq_atomic_fetch_sub (size_t *ptr, size_t value)
+{
+    return zmosq_atomic_fetch_add (ptr, (size_t) 0 - value);
+}
+
+static __inline void
+zmosq_atomic_fence (void)
+{
+    MemoryBarrier ();
+}
+
+static __inline int
+zmosq_clz64 (uint64_t value)
+{
+    unsigned long bit;
+#   if defined (_WIN64)
+    _BitScanReverse64 (&bit, value);
+#   else
+    if (value >> 32) {
+        _BitScanReverse (&bit, (unsigned long) (value >> 32));
+        bit += 32;
+    }
+    else
+        _BitScanReverse (&bit, (unsigned long) value);
+#   endif
+    return 63 - (int) bit;
+}
+
+#else
+#   error "zmosq_atomic needs GCC or Clang atomic builtins, or MSVC"
+#endif
+
+#endif
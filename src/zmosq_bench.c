@@ -0,0 +1,536 @@
+/*  =========================================================================
+    zmosq_bench - Throughput and latency benchmark
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.
+    This file is part of the Malamute Project.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    zmosq_bench - Throughput and latency benchmark
+@discuss
+    Publishes messages through one or more zmosq_server actors to a MQTT
+    broker and receives them back by another zmosq_server actor subscribed
+    to all of them. Every combination of payload size, QoS, number of topics
+    and number of publishers given on the command line is one run. Runs are
+    printed to stdout as a JSON array, so results of two versions can be
+    compared by a script.
+
+    Without --host the embedded zmosq_broker stand-in is used, with
+    --mosquitto a local mosquitto broker is started on --port and killed
+    once the benchmark is done.
+
+    Payload starts with zclock_usecs of the moment the message was sent, so
+    latency is measured end to end, from the PUBLISH command to the message
+    read from the pipe of the subscriber.
+
+    With --hot-path no broker is used. Synthetic messages are fed straight
+    to the message callback of the actor and commands straight to its
+    command handler, to measure nsecs and allocations per message of the
+    forwarding hot path alone. Allocations are counted on glibc only, in
+    a build configured with bench allocations, which is not installed.
+@end
+*/
+
+#include "zmsq_classes.h"
+
+#define BENCH_TOPIC_PREFIX  "zmosq_bench/"
+#define BENCH_STAMP_SIZE    8
+#define BENCH_LINGER_MSECS  2000
+
+//  Count allocations of the whole process. glibc exports its allocator
+//  under __libc_ names, so we can put counting malloc in front of it. It
+//  replaces allocator of the whole process, so it's only built on request
+//  (ZMOSQ_BENCH_ALLOCATIONS) and such binary is not installed. strdup and
+//  other libc functions allocate through these too.
+#if defined (__GLIBC__) && defined (ZMOSQ_BENCH_ALLOCATIONS)
+#   define BENCH_HAVE_ALLOCATIONS
+#   include <malloc.h>
+#   include "zmosq_atomic.h"
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t count, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void *__libc_memalign (size_t alignment, size_t size);
+
+static size_t s_allocations = 0;
+
+void *
+malloc (size_t size)
+{
+    zmosq_atomic_fetch_add (&s_allocations, 1);
+    return __libc_malloc (size);
+}
+
+void *
+calloc (size_t count, size_t size)
+{
+    zmosq_atomic_fetch_add (&s_allocations, 1);
+    return __libc_calloc (count, size);
+}
+
+//  Shrinking block, or growing it within its usable size, is not counted
+void *
+realloc (void *ptr, size_t size)
+{
+    if (!ptr || size > malloc_usable_size (ptr))
+        zmosq_atomic_fetch_add (&s_allocations, 1);
+    return __libc_realloc (ptr, size);
+}
+
+void *
+memalign (size_t alignment, size_t size)
+{
+    zmosq_atomic_fetch_add (&s_allocations, 1);
+    return __libc_memalign (alignment, size);
+}
+
+void *
+aligned_alloc (size_t alignment, size_t size)
+{
+    return memalign (alignment, size);
+}
+
+int
+posix_memalign (void **ptr_p, size_t alignment, size_t size)
+{
+    if (alignment % sizeof (void *) || (alignment & (alignment - 1)))
+        return EINVAL;
+    void *ptr = memalign (alignment, size);
+    if (!ptr)
+        return ENOMEM;
+    *ptr_p = ptr;
+    return 0;
+}
+#endif
+
+//  Return number of allocations so far, 0 if they are not counted
+static size_t
+s_allocations_now (void)
+{
+#if defined (BENCH_HAVE_ALLOCATIONS)
+    return zmosq_atomic_load (&s_allocations, ZMOSQ_RELAXED);
+#else
+    return 0;
+#endif
+}
+
+//  One run of the benchmark
+typedef struct {
+    size_t payload;             //  bytes of payload, at least BENCH_STAMP_SIZE
+    int qos;                    //  QoS of published messages
+    size_t topics;              //  messages are spread over so many topics
+    size_t publishers;          //  and so many publishing actors
+    size_t messages;            //  messages to publish
+    size_t rate;                //  messages per second, 0 = as fast as possible
+} bench_run_t;
+
+//  Parse comma separated list of numbers, return number of items parsed
+static size_t
+s_parse_list (const char *text, size_t *items, size_t max_items)
+{
+    size_t count = 0;
+    while (text && *text && count < max_items) {
+        char *end;
+        items [count++] = strtoul (text, &end, 10);
+        text = *end == ','? end + 1: NULL;
+    }
+    return count;
+}
+
+static int
+s_compare_latency (const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+    return x < y? -1: x > y? 1: 0;
+}
+
+static int64_t
+s_percentile (int64_t *sorted, size_t count, double percentile)
+{
+    if (count == 0)
+        return 0;
+    size_t index = (size_t) (count * percentile / 100.0);
+    return sorted [index < count? index: count - 1];
+}
+
+//  Start zmosq_server actor connected to the broker, wait until it's
+//  connected and subscribed
+static zactor_t *
+s_server_new (const char *host, int port, const char *topic)
+{
+    zactor_t *server = zactor_new (zmosq_server_actor, NULL);
+    assert (server);
+    char *porta = zsys_sprintf ("%d", port);
+    zstr_sendx (server, "CONNECT", host, porta, "10", "", NULL);
+    zstr_free (&porta);
+    if (topic)
+        zstr_sendx (server, "SUBSCRIBE", topic, NULL);
+    zstr_sendx (server, "START", "5000", NULL);
+    char *reply, *status;
+    zstr_recvx (server, &reply, &status, NULL);
+    if (!status || !streq (status, "OK"))
+        zsys_warning ("zmosq_bench: %s:%d did not start in time", host, port);
+    zstr_free (&reply);
+    zstr_free (&status);
+    return server;
+}
+
+//  Read message from subscriber and record its latency, return 0 if OK,
+//  -1 if it's not a benchmark message
+static int
+s_receive (zactor_t *subscriber, int64_t *latencies, size_t *received)
+{
+    zmsg_t *msg = zmsg_recv (subscriber);
+    if (!msg)
+        return -1;
+    int64_t now = zclock_usecs ();
+    zframe_t *topic = zmsg_first (msg);
+    zframe_t *payload = zmsg_next (msg);
+    int rc = -1;
+    if (topic && payload
+    &&  zframe_size (payload) >= BENCH_STAMP_SIZE
+    &&  zframe_size (topic) > strlen (BENCH_TOPIC_PREFIX)
+    &&  memcmp (zframe_data (topic), BENCH_TOPIC_PREFIX, strlen (BENCH_TOPIC_PREFIX)) == 0) {
+        byte *data = zframe_data (payload);
+        int64_t sent = 0;
+        int shift;
+        for (shift = 0; shift < BENCH_STAMP_SIZE; shift++)
+            sent = (sent << 8) | data [shift];
+        latencies [(*received)++] = now - sent;
+        rc = 0;
+    }
+    zmsg_destroy (&msg);
+    return rc;
+}
+
+//  Do one run and print its result as JSON object
+static void
+s_bench (bench_run_t *run, const char *host, int port, bool first, bool verbose)
+{
+    zactor_t *subscriber = s_server_new (host, port, BENCH_TOPIC_PREFIX "#");
+    zactor_t **publishers = (zactor_t **) zmalloc (run->publishers * sizeof (zactor_t *));
+    assert (publishers);
+    size_t index;
+    for (index = 0; index < run->publishers; index++)
+        publishers [index] = s_server_new (host, port, NULL);
+
+    byte *payload = (byte *) zmalloc (run->payload);
+    assert (payload);
+    int64_t *latencies = (int64_t *) zmalloc (run->messages * sizeof (int64_t));
+    assert (latencies);
+    char topic [64];
+    size_t received = 0;
+
+    int64_t started = zclock_usecs ();
+    for (index = 0; index < run->messages; index++) {
+        if (run->rate) {
+            int64_t due = started + (int64_t) (index * 1000000 / run->rate);
+            while (zclock_usecs () < due) {
+                if (zsock_events (zactor_sock (subscriber)) & ZMQ_POLLIN)
+                    s_receive (subscriber, latencies, &received);
+                else
+                    zclock_sleep (0);
+            }
+        }
+        snprintf (topic, sizeof (topic), BENCH_TOPIC_PREFIX "%zu", index % run->topics);
+        int64_t now = zclock_usecs ();
+        int shift;
+        for (shift = 0; shift < BENCH_STAMP_SIZE; shift++)
+            payload [shift] = (byte) (now >> (8 * (BENCH_STAMP_SIZE - 1 - shift)));
+
+        zmsg_t *msg = zmsg_new ();
+        int rc = zmosq_server_publish_append (msg, topic, run->qos, false, payload, run->payload);
+        assert (rc == 0);
+        zmsg_send (&msg, publishers [index % run->publishers]);
+
+        //  Don't let the subscriber fall behind while we publish
+        while (zsock_events (zactor_sock (subscriber)) & ZMQ_POLLIN)
+            s_receive (subscriber, latencies, &received);
+    }
+
+    //  Collect the rest, QoS 0 messages may be lost
+    zpoller_t *poller = zpoller_new (subscriber, NULL);
+    assert (poller);
+    int64_t last = zclock_usecs ();
+    while (received < run->messages) {
+        if (!zpoller_wait (poller, BENCH_LINGER_MSECS))
+            break;
+        s_receive (subscriber, latencies, &received);
+        last = zclock_usecs ();
+    }
+    zpoller_destroy (&poller);
+
+    qsort (latencies, received, sizeof (int64_t), s_compare_latency);
+    double seconds = (last - started) / 1000000.0;
+    if (seconds <= 0)
+        seconds = 1e-6;
+    printf ("%s  {\"payload\": %zu, \"qos\": %d, \"topics\": %zu, \"publishers\": %zu, "
+            "\"messages\": %zu, \"received\": %zu, \"msgs_per_sec\": %.0f, \"mb_per_sec\": %.3f, "
+            "\"latency_usecs\": {\"p50\": %" PRId64 ", \"p99\": %" PRId64 ", \"p999\": %" PRId64 ", \"max\": %" PRId64 "}}",
+            first? "": ",\n",
+            run->payload, run->qos, run->topics, run->publishers,
+            run->messages, received, received / seconds,
+            received * run->payload / seconds / 1000000.0,
+            s_percentile (latencies, received, 50),
+            s_percentile (latencies, received, 99),
+            s_percentile (latencies, received, 99.9),
+            received? latencies [received - 1]: 0);
+    fflush (stdout);
+    if (verbose)
+        zsys_info ("zmosq_bench: payload %zu qos %d topics %zu publishers %zu: %zu of %zu received",
+            run->payload, run->qos, run->topics, run->publishers, received, run->messages);
+
+    free (latencies);
+    free (payload);
+    for (index = 0; index < run->publishers; index++)
+        zactor_destroy (&publishers [index]);
+    free (publishers);
+    zactor_destroy (&subscriber);
+}
+
+//  Measure hot path of one mode and print it as JSON object
+static void
+s_bench_hot_path (const char *path, const char *mode, size_t payload, size_t messages, bool first)
+{
+    //  Warm up caches and pools
+    if (streq (path, "deliver"))
+        zmosq_server_bench_deliver (mode, messages / 10 + 1, payload);
+    else
+        zmosq_server_bench_publish (streq (mode, "binary"), messages / 10 + 1, payload);
+
+    size_t allocations = s_allocations_now ();
+    double nsecs = streq (path, "deliver")
+        ? zmosq_server_bench_deliver (mode, messages, payload)
+        : zmosq_server_bench_publish (streq (mode, "binary"), messages, payload);
+    allocations = s_allocations_now () - allocations;
+
+    printf ("%s  {\"path\": \"%s\", \"mode\": \"%s\", \"payload\": %zu, \"messages\": %zu, "
+            "\"nsecs_per_msg\": %.1f, \"allocs_per_msg\": ",
+            first? "": ",\n", path, mode, payload, messages, nsecs);
+#if defined (BENCH_HAVE_ALLOCATIONS)
+    printf ("%.2f}", (double) allocations / messages);
+#else
+    printf ("null}");
+#endif
+    fflush (stdout);
+}
+
+#if defined (__WINDOWS__)
+//  No fork and exec on Windows, run mosquitto by hand and use --host
+static int
+s_broker_start (int port, bool verbose)
+{
+    zsys_error ("zmosq_bench: --mosquitto is not supported on Windows, use --host");
+    return -1;
+}
+
+static void
+s_broker_stop (int pid)
+{
+}
+#else
+//  Start local mosquitto broker, return its pid or -1
+static int
+s_broker_start (int port, bool verbose)
+{
+    pid_t pid = fork ();
+    if (pid == 0) {
+        //  upstream mosquitto installs binary to /usr/sbin
+        char *path = zsys_sprintf ("/usr/sbin:%s", getenv ("PATH"));
+        setenv ("PATH", path, 1);
+        zstr_free (&path);
+        char *porta = zsys_sprintf ("%d", port);
+        if (verbose)
+            execlp ("mosquitto", "mosquitto", "--verbose", "-p", porta, (char *) NULL);
+        else
+            execlp ("mosquitto", "mosquitto", "-p", porta, (char *) NULL);
+        zsys_error ("zmosq_bench: can't start mosquitto: %s", strerror (errno));
+        _exit (1);
+    }
+    if (pid > 0)
+        zclock_sleep (500);
+    return (int) pid;
+}
+
+//  Stop local mosquitto broker and wait for it
+static void
+s_broker_stop (int pid)
+{
+    kill ((pid_t) pid, SIGTERM);
+    waitpid ((pid_t) pid, NULL, 0);
+}
+#endif
+
+int main (int argc, char *argv [])
+{
+    bool verbose = false;
+    const char *host = NULL;
+    int port = 18830;
+    size_t payloads [16] = { 16, 256, 4096 };
+    size_t payloads_count = 3;
+    size_t qoses [3] = { 0, 1 };
+    size_t qoses_count = 2;
+    size_t topics [16] = { 1, 100 };
+    size_t topics_count = 2;
+    size_t publishers [16] = { 1, 4 };
+    size_t publishers_count = 2;
+    size_t messages = 100000;
+    size_t rate = 0;
+    bool hot_path = false;
+    bool mosquitto = false;
+
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        const char *value = argn + 1 < argc? argv [argn + 1]: NULL;
+        if (streq (argv [argn], "--help")
+        ||  streq (argv [argn], "-h")) {
+            puts ("zmosq_bench [options] ...");
+            puts ("  --host host            MQTT broker, default is embedded zmosq_broker");
+            puts ("  --port port            port of MQTT broker, default 18830");
+            puts ("  --mosquitto            start local mosquitto on --port instead of zmosq_broker");
+            puts ("  --payload n,...        payload sizes in bytes, default 16,256,4096");
+            puts ("  --qos n,...            QoS levels, default 0,1");
+            puts ("  --topics n,...         numbers of topics, default 1,100");
+            puts ("  --publishers n,...     numbers of publishing actors, default 1,4");
+            puts ("  --messages n           messages per run, default 100000");
+            puts ("  --rate n               messages per second, default 0 = unlimited");
+            puts ("  --hot-path             measure hot path of the actor alone, no broker");
+            puts ("  --verbose / -v         verbose output");
+            puts ("  --help / -h            this information");
+            return 0;
+        }
+        else
+        if (streq (argv [argn], "--verbose")
+        ||  streq (argv [argn], "-v"))
+            verbose = true;
+        else
+        if (streq (argv [argn], "--host") && value) {
+            host = value;
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--port") && value) {
+            port = atoi (value);
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--payload") && value) {
+            payloads_count = s_parse_list (value, payloads, 16);
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--qos") && value) {
+            qoses_count = s_parse_list (value, qoses, 3);
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--topics") && value) {
+            topics_count = s_parse_list (value, topics, 16);
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--publishers") && value) {
+            publishers_count = s_parse_list (value, publishers, 16);
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--messages") && value) {
+            messages = strtoul (value, NULL, 10);
+            argn++;
+        }
+        else
+        if (streq (argv [argn], "--hot-path"))
+            hot_path = true;
+        else
+        if (streq (argv [argn], "--mosquitto"))
+            mosquitto = true;
+        else
+        if (streq (argv [argn], "--rate") && value) {
+            rate = strtoul (value, NULL, 10);
+            argn++;
+        }
+        else {
+            printf ("Unknown option: %s\n", argv [argn]);
+            return 1;
+        }
+    }
+    if (messages == 0) {
+        printf ("--messages must be at least 1\n");
+        return 1;
+    }
+
+    if (hot_path) {
+        const char *deliver_modes [] = { "thread", "ring", "actor", "direct" };
+        const char *publish_modes [] = { "string", "binary" };
+        bool first = true;
+        printf ("[\n");
+        size_t payload, mode;
+        for (payload = 0; payload < payloads_count; payload++) {
+            for (mode = 0; mode < sizeof (deliver_modes) / sizeof (deliver_modes [0]); mode++) {
+                s_bench_hot_path ("deliver", deliver_modes [mode], payloads [payload], messages, first);
+                first = false;
+            }
+            for (mode = 0; mode < sizeof (publish_modes) / sizeof (publish_modes [0]); mode++)
+                s_bench_hot_path ("publish", publish_modes [mode], payloads [payload], messages, first);
+        }
+        printf ("\n]\n");
+        return 0;
+    }
+
+    int broker = -1;
+    zmosq_broker_t *embedded = NULL;
+    if (!host && mosquitto) {
+        host = "127.0.0.1";
+        broker = s_broker_start (port, verbose);
+        if (broker == -1) {
+            zsys_error ("zmosq_bench: can't start mosquitto");
+            return 1;
+        }
+    }
+    else
+    if (!host) {
+        host = "127.0.0.1";
+        embedded = zmosq_broker_new ("tcp://127.0.0.1:*");
+        if (!embedded) {
+            zsys_error ("zmosq_bench: can't start zmosq_broker");
+            return 1;
+        }
+        port = zmosq_broker_port (embedded);
+    }
+
+    printf ("[\n");
+    size_t runs = payloads_count * qoses_count * topics_count * publishers_count;
+    size_t index;
+    for (index = 0; index < runs && !zsys_interrupted; index++) {
+        //  Last option changes fastest
+        size_t rest = index;
+        size_t publisher = publishers [rest % publishers_count];
+        rest /= publishers_count;
+        size_t topic = topics [rest % topics_count];
+        rest /= topics_count;
+        size_t qos = qoses [rest % qoses_count];
+        rest /= qoses_count;
+        size_t payload = payloads [rest];
+        bench_run_t run = {
+            payload < BENCH_STAMP_SIZE? BENCH_STAMP_SIZE: payload,
+            qos > 2? 2: (int) qos,
+            topic? topic: 1,
+            publisher? publisher: 1,
+            messages,
+            rate
+        };
+        s_bench (&run, host, port, index == 0, verbose);
+    }
+    printf ("\n]\n");
+
+    if (broker > 0)
+        s_broker_stop (broker);
+    zmosq_broker_destroy (&embedded);
+    return 0;
+}
@@ -0,0 +1,921 @@
+/*  =========================================================================
+    zmosq_broker - Embedded MQTT broker stand-in
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.
+    This file is part of the Malamute Project.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+/*
+@header
+    zmosq_broker - Embedded MQTT broker stand-in
+@discuss
+    Small MQTT 3.1 and 3.1.1 broker running in an actor thread of the
+    process, so tests and benchmarks don't need an installed broker and
+    start in milliseconds. It listens on a ZMQ_STREAM socket, which takes
+    care of TCP, and knows CONNECT, SUBSCRIBE, UNSUBSCRIBE, PUBLISH with
+    QoS 0, 1 and 2 acknowledgements, retained messages and PINGREQ.
+
+    It is not a broker for production: there are no persistent sessions,
+    wills, authentication or retries of unacknowledged messages, and topics
+    are matched by walking all subscriptions.
+@end
+*/
+
+#include "zmsq_classes.h"
+
+//  MQTT control packet types
+#define MQTT_CONNECT        1
+#define MQTT_CONNACK        2
+#define MQTT_PUBLISH        3
+#define MQTT_PUBACK         4
+#define MQTT_PUBREC         5
+#define MQTT_PUBREL         6
+#define MQTT_PUBCOMP        7
+#define MQTT_SUBSCRIBE      8
+#define MQTT_SUBACK         9
+#define MQTT_UNSUBSCRIBE    10
+#define MQTT_UNSUBACK       11
+#define MQTT_PINGREQ        12
+#define MQTT_PINGRESP       13
+#define MQTT_DISCONNECT     14
+
+//  Subscription of a client
+typedef struct {
+    char *filter;               //  MQTT topic filter
+    int qos;                    //  Granted QoS
+} s_subscription_t;
+
+//  Retained message of a topic
+typedef struct {
+    zframe_t *payload;
+    int qos;
+} s_retained_t;
+
+//  Connection of a MQTT client
+typedef struct {
+    zframe_t *routing_id;       //  ZMQ_STREAM identity of the connection
+    char *client_id;            //  MQTT client id, NULL until CONNECT
+    byte *buffer;               //  Bytes received and not parsed yet
+    size_t size;                //  Number of bytes in buffer
+    size_t max_size;            //  Allocated size of buffer
+    uint16_t packet_id;         //  Id of last QoS 1/2 packet sent to client
+    zlistx_t *subscriptions;    //  s_subscription_t items
+    zhashx_t *received;         //  QoS 2 packet ids not released yet
+} s_session_t;
+
+//  State of the broker actor
+typedef struct {
+    zsock_t *pipe;              //  Actor command pipe
+    zsock_t *stream;            //  Socket of client connections
+    bool verbose;               //  Log packets?
+    bool terminated;            //  Did caller ask us to quit?
+    zhashx_t *sessions;         //  s_session_t by routing id in hex
+    zhashx_t *retained;         //  s_retained_t by topic
+} s_broker_t;
+
+//  Mosquitto library is shared by all users in process
+#if defined (__UNIX__)
+static pthread_mutex_t s_mosquitto_mutex = PTHREAD_MUTEX_INITIALIZER;
+#   define s_mosquitto_lock()   pthread_mutex_lock (&s_mosquitto_mutex)
+#   define s_mosquitto_unlock() pthread_mutex_unlock (&s_mosquitto_mutex)
+#else
+#   define s_mosquitto_lock()
+#   define s_mosquitto_unlock()
+#endif
+static size_t s_mosquitto_refs = 0;
+
+//  Structure of our class
+struct _zmosq_broker_t {
+    zactor_t *actor;            //  Broker actor
+    char *endpoint;             //  Endpoint it's bound to
+    int port;                   //  TCP port, 0 if not TCP
+};
+
+
+//  --------------------------------------------------------------------------
+//  Subscriptions, retained messages and sessions
+
+static void
+s_subscription_free (void **item_p)
+{
+    s_subscription_t *subscription = (s_subscription_t *) *item_p;
+    if (subscription) {
+        zstr_free (&subscription->filter);
+        free (subscription);
+        *item_p = NULL;
+    }
+}
+
+static void
+s_retained_free (void **item_p)
+{
+    s_retained_t *retained = (s_retained_t *) *item_p;
+    if (retained) {
+        zframe_destroy (&retained->payload);
+        free (retained);
+        *item_p = NULL;
+    }
+}
+
+static s_session_t *
+s_session_new (zframe_t *routing_id)
+{
+    s_session_t *self = (s_session_t *) zmalloc (sizeof (s_session_t));
+    assert (self);
+    self->routing_id = zframe_dup (routing_id);
+    self->subscriptions = zlistx_new ();
+    self->received = zhashx_new ();
+    assert (self->routing_id && self->subscriptions && self->received);
+    zlistx_set_destructor (self->subscriptions, s_subscription_free);
+    return self;
+}
+
+static void
+s_session_free (void **item_p)
+{
+    s_session_t *self = (s_session_t *) *item_p;
+    if (self) {
+        zframe_destroy (&self->routing_id);
+        zstr_free (&self->client_id);
+        free (self->buffer);
+        zlistx_destroy (&self->subscriptions);
+        zhashx_destroy (&self->received);
+        free (self);
+        *item_p = NULL;
+    }
+}
+
+
+//  Return highest QoS of subscriptions of session matching topic, -1 if
+//  there is none
+
+static int
+s_session_matches (s_session_t *self, const char *topic)
+{
+    int qos = -1;
+    s_subscription_t *subscription = (s_subscription_t *) zlistx_first (self->subscriptions);
+    while (subscription) {
+        bool matches = false;
+        if (subscription->qos > qos
+        &&  mosquitto_topic_matches_sub (subscription->filter, topic, &matches) == MOSQ_ERR_SUCCESS
+        &&  matches)
+            qos = subscription->qos;
+        subscription = (s_subscription_t *) zlistx_next (self->subscriptions);
+    }
+    return qos;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Reading and writing of MQTT packets
+
+typedef struct {
+    const byte *data;           //  Next byte to read
+    size_t size;                //  Bytes left
+    bool error;                 //  Did we read past the end?
+} s_reader_t;
+
+static int
+s_read_byte (s_reader_t *reader)
+{
+    if (reader->size < 1) {
+        reader->error = true;
+        return 0;
+    }
+    reader->size--;
+    return *reader->data++;
+}
+
+static uint16_t
+s_read_uint16 (s_reader_t *reader)
+{
+    uint16_t value = (uint16_t) (s_read_byte (reader) << 8);
+    return value | (uint16_t) s_read_byte (reader);
+}
+
+//  Read length prefixed string, return fresh string or NULL on error
+static char *
+s_read_string (s_reader_t *reader)
+{
+    size_t size = s_read_uint16 (reader);
+    if (reader->error || reader->size < size) {
+        reader->error = true;
+        return NULL;
+    }
+    char *string = (char *) malloc (size + 1);
+    assert (string);
+    memcpy (string, reader->data, size);
+    string [size] = 0;
+    reader->data += size;
+    reader->size -= size;
+    return string;
+}
+
+
+//  Return new packet of type with flags in fixed header and room for body
+//  of size bytes, which starts at *body_p
+
+static zframe_t *
+s_packet_new (int type, int flags, size_t size, byte **body_p)
+{
+    byte header [5];
+    size_t header_size = 0;
+    header [header_size++] = (byte) ((type << 4) | flags);
+    size_t rest = size;
+    do {
+        byte digit = (byte) (rest % 128);
+        rest /= 128;
+        header [header_size++] = rest? digit | 0x80: digit;
+    } while (rest);
+
+    zframe_t *packet = zframe_new (NULL, header_size + size);
+    assert (packet);
+    memcpy (zframe_data (packet), header, header_size);
+    *body_p = zframe_data (packet) + header_size;
+    return packet;
+}
+
+
+static void
+s_session_send (s_broker_t *self, s_session_t *session, zframe_t **packet_p)
+{
+    zframe_send (&session->routing_id, self->stream, ZFRAME_MORE + ZFRAME_REUSE);
+    zframe_send (packet_p, self->stream, 0);
+}
+
+
+//  Send packet made only of packet id, like PUBACK
+
+static void
+s_session_send_id (s_broker_t *self, s_session_t *session, int type, int flags, uint16_t id)
+{
+    byte *body;
+    zframe_t *packet = s_packet_new (type, flags, 2, &body);
+    body [0] = (byte) (id >> 8);
+    body [1] = (byte) id;
+    s_session_send (self, session, &packet);
+}
+
+
+static void
+s_session_publish (
+    s_broker_t *self, s_session_t *session, const char *topic,
+    const byte *payload, size_t size, int qos, bool retain)
+{
+    size_t topic_size = strlen (topic);
+    byte *body;
+    zframe_t *packet = s_packet_new (
+        MQTT_PUBLISH, (qos << 1) | (retain? 1: 0),
+        2 + topic_size + (qos? 2: 0) + size, &body);
+    *body++ = (byte) (topic_size >> 8);
+    *body++ = (byte) topic_size;
+    memcpy (body, topic, topic_size);
+    body += topic_size;
+    if (qos) {
+        if (++session->packet_id == 0)
+            session->packet_id = 1;
+        *body++ = (byte) (session->packet_id >> 8);
+        *body++ = (byte) session->packet_id;
+    }
+    if (size)
+        memcpy (body, payload, size);
+    s_session_send (self, session, &packet);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Handlers of packets from clients, return 0 if OK, -1 to close connection
+
+static int
+s_handle_connect (s_broker_t *self, s_session_t *session, s_reader_t *reader)
+{
+    char *protocol = s_read_string (reader);
+    int level = s_read_byte (reader);
+    s_read_byte (reader);           //  Flags, will and credentials ignored
+    s_read_uint16 (reader);         //  Keepalive, we don't time clients out
+    char *client_id = s_read_string (reader);
+    if (reader->error || session->client_id) {
+        zstr_free (&protocol);
+        zstr_free (&client_id);
+        return -1;
+    }
+    bool accepted = (streq (protocol, "MQTT") && level == 4)
+                 || (streq (protocol, "MQIsdp") && level == 3);
+    zstr_free (&protocol);
+    session->client_id = client_id;
+
+    byte *body;
+    zframe_t *packet = s_packet_new (MQTT_CONNACK, 0, 2, &body);
+    body [0] = 0;                   //  No session present
+    body [1] = accepted? 0: 1;      //  1 = unacceptable protocol version
+    s_session_send (self, session, &packet);
+    if (self->verbose)
+        zsys_debug ("zmosq_broker: CONNECT %s %s", client_id, accepted? "accepted": "refused");
+    return accepted? 0: -1;
+}
+
+
+static int
+s_handle_publish (s_broker_t *self, s_session_t *session, int flags, s_reader_t *reader)
+{
+    int qos = (flags >> 1) & 3;
+    bool retain = (flags & 1) != 0;
+    char *topic = s_read_string (reader);
+    uint16_t id = qos? s_read_uint16 (reader): 0;
+    if (reader->error || qos == 3 || (qos && id == 0)) {
+        zstr_free (&topic);
+        return -1;
+    }
+    const byte *payload = reader->data;
+    size_t size = reader->size;
+    if (self->verbose)
+        zsys_debug ("zmosq_broker: PUBLISH %s qos %d retain %d, %zu bytes", topic, qos, retain, size);
+
+    if (qos == 1)
+        s_session_send_id (self, session, MQTT_PUBACK, 0, id);
+    else
+    if (qos == 2) {
+        s_session_send_id (self, session, MQTT_PUBREC, 0, id);
+        char key [8];
+        snprintf (key, sizeof (key), "%u", id);
+        //  Message was forwarded already, client missed our PUBREC
+        if (zhashx_insert (session->received, key, (void *) 1) == -1) {
+            zstr_free (&topic);
+            return 0;
+        }
+    }
+
+    if (retain) {
+        if (size == 0)
+            zhashx_delete (self->retained, topic);
+        else {
+            s_retained_t *retained = (s_retained_t *) zmalloc (sizeof (s_retained_t));
+            assert (retained);
+            retained->payload = zframe_new (payload, size);
+            retained->qos = qos;
+            zhashx_update (self->retained, topic, retained);
+        }
+    }
+
+    s_session_t *subscriber = (s_session_t *) zhashx_first (self->sessions);
+    while (subscriber) {
+        int subscribed = s_session_matches (subscriber, topic);
+        if (subscribed >= 0)
+            s_session_publish (self, subscriber, topic, payload, size,
+                subscribed < qos? subscribed: qos, false);
+        subscriber = (s_session_t *) zhashx_next (self->sessions);
+    }
+    zstr_free (&topic);
+    return 0;
+}
+
+
+static int
+s_handle_subscribe (s_broker_t *self, s_session_t *session, s_reader_t *reader)
+{
+    uint16_t id = s_read_uint16 (reader);
+    zlistx_t *added = zlistx_new ();
+    assert (added);
+    //  Each filter is at least 2 length bytes and a QoS byte
+    zframe_t *granted = zframe_new (NULL, reader->size / 3);
+    assert (granted);
+    size_t filters = 0;
+    while (reader->size && !reader->error) {
+        char *filter = s_read_string (reader);
+        int qos = s_read_byte (reader);
+        if (reader->error) {
+            zstr_free (&filter);
+            break;
+        }
+        if (self->verbose)
+            zsys_debug ("zmosq_broker: SUBSCRIBE %s %s qos %d", session->client_id, filter, qos);
+        byte code = 0x80;           //  Failure
+        if (qos <= 2 && mosquitto_sub_topic_check (filter) == MOSQ_ERR_SUCCESS) {
+            //  Same filter again replaces the subscription
+            s_subscription_t *subscription = (s_subscription_t *) zlistx_first (session->subscriptions);
+            while (subscription && !streq (subscription->filter, filter))
+                subscription = (s_subscription_t *) zlistx_next (session->subscriptions);
+            if (!subscription) {
+                subscription = (s_subscription_t *) zmalloc (sizeof (s_subscription_t));
+                assert (subscription);
+                subscription->filter = strdup (filter);
+                zlistx_add_end (session->subscriptions, subscription);
+            }
+            subscription->qos = qos;
+            zlistx_add_end (added, subscription);
+            code = (byte) qos;
+        }
+        zframe_data (granted) [filters++] = code;
+        zstr_free (&filter);
+    }
+    if (reader->error || filters == 0) {
+        zlistx_destroy (&added);
+        zframe_destroy (&granted);
+        return -1;
+    }
+
+    byte *body;
+    zframe_t *packet = s_packet_new (MQTT_SUBACK, 0, 2 + filters, &body);
+    body [0] = (byte) (id >> 8);
+    body [1] = (byte) id;
+    memcpy (body + 2, zframe_data (granted), filters);
+    s_session_send (self, session, &packet);
+    zframe_destroy (&granted);
+
+    //  New subscriptions get retained messages they match
+    s_subscription_t *subscription = (s_subscription_t *) zlistx_first (added);
+    while (subscription) {
+        s_retained_t *retained = (s_retained_t *) zhashx_first (self->retained);
+        while (retained) {
+            const char *topic = (const char *) zhashx_cursor (self->retained);
+            bool matches = false;
+            if (mosquitto_topic_matches_sub (subscription->filter, topic, &matches) == MOSQ_ERR_SUCCESS
+            &&  matches)
+                s_session_publish (self, session, topic,
+                    zframe_data (retained->payload), zframe_size (retained->payload),
+                    subscription->qos < retained->qos? subscription->qos: retained->qos, true);
+            retained = (s_retained_t *) zhashx_next (self->retained);
+        }
+        subscription = (s_subscription_t *) zlistx_next (added);
+    }
+    zlistx_destroy (&added);
+    return 0;
+}
+
+
+static int
+s_handle_unsubscribe (s_broker_t *self, s_session_t *session, s_reader_t *reader)
+{
+    uint16_t id = s_read_uint16 (reader);
+    while (reader->size && !reader->error) {
+        char *filter = s_read_string (reader);
+        if (!filter)
+            break;
+        if (self->verbose)
+            zsys_debug ("zmosq_broker: UNSUBSCRIBE %s %s", session->client_id, filter);
+        s_subscription_t *subscription = (s_subscription_t *) zlistx_first (session->subscriptions);
+        while (subscription) {
+            if (streq (subscription->filter, filter)) {
+                zlistx_delete (session->subscriptions, zlistx_cursor (session->subscriptions));
+                break;
+            }
+            subscription = (s_subscription_t *) zlistx_next (session->subscriptions);
+        }
+        zstr_free (&filter);
+    }
+    if (reader->error)
+        return -1;
+    s_session_send_id (self, session, MQTT_UNSUBACK, 0, id);
+    return 0;
+}
+
+
+//  Handle one packet from client
+
+static int
+s_session_handle (s_broker_t *self, s_session_t *session, int type, int flags, const byte *data, size_t size)
+{
+    s_reader_t reader = { data, size, false };
+    if (!session->client_id && type != MQTT_CONNECT)
+        return -1;                  //  CONNECT must come first
+
+    switch (type) {
+        case MQTT_CONNECT:
+            return s_handle_connect (self, session, &reader);
+        case MQTT_PUBLISH:
+            return s_handle_publish (self, session, flags, &reader);
+        case MQTT_PUBREL: {
+            uint16_t id = s_read_uint16 (&reader);
+            char key [8];
+            snprintf (key, sizeof (key), "%u", id);
+            zhashx_delete (session->received, key);
+            s_session_send_id (self, session, MQTT_PUBCOMP, 0, id);
+            return reader.error? -1: 0;
+        }
+        case MQTT_PUBREC:
+            //  Second step of QoS 2 message we sent
+            s_session_send_id (self, session, MQTT_PUBREL, 2, s_read_uint16 (&reader));
+            return reader.error? -1: 0;
+        case MQTT_PUBACK:
+        case MQTT_PUBCOMP:
+            return 0;               //  We don't retry, nothing to forget
+        case MQTT_SUBSCRIBE:
+            return s_handle_subscribe (self, session, &reader);
+        case MQTT_UNSUBSCRIBE:
+            return s_handle_unsubscribe (self, session, &reader);
+        case MQTT_PINGREQ: {
+            byte *body;
+            zframe_t *packet = s_packet_new (MQTT_PINGRESP, 0, 0, &body);
+            s_session_send (self, session, &packet);
+            return 0;
+        }
+        case MQTT_DISCONNECT:
+            return -1;
+    }
+    return -1;
+}
+
+
+//  Add data received from client to its buffer and handle all complete
+//  packets. Return -1 if connection is to be closed.
+
+static int
+s_session_input (s_broker_t *self, s_session_t *session, zframe_t *data)
+{
+    if (session->size + zframe_size (data) > session->max_size) {
+        size_t max_size = (session->size + zframe_size (data)) * 2;
+        byte *buffer = (byte *) realloc (session->buffer, max_size);
+        assert (buffer);
+        session->buffer = buffer;
+        session->max_size = max_size;
+    }
+    memcpy (session->buffer + session->size, zframe_data (data), zframe_size (data));
+    session->size += zframe_size (data);
+
+    int rc = 0;
+    size_t offset = 0;
+    while (rc == 0 && session->size - offset >= 2) {
+        const byte *packet = session->buffer + offset;
+        size_t available = session->size - offset;
+        //  Remaining length is 1 to 4 bytes, 7 bits each
+        size_t length = 0, header_size = 1;
+        bool complete = false;
+        while (header_size < available && header_size <= 4) {
+            byte digit = packet [header_size++];
+            length |= (size_t) (digit & 0x7f) << (7 * (header_size - 2));
+            if ((digit & 0x80) == 0) {
+                complete = true;
+                break;
+            }
+        }
+        if (!complete) {
+            if (header_size > 4)
+                rc = -1;            //  Malformed remaining length
+            break;
+        }
+        if (available < header_size + length)
+            break;                  //  Wait for rest of packet
+        rc = s_session_handle (self, session, packet [0] >> 4, packet [0] & 0x0f,
+                               packet + header_size, length);
+        offset += header_size + length;
+    }
+    session->size -= offset;
+    memmove (session->buffer, session->buffer + offset, session->size);
+    return rc;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Broker actor
+
+static void
+s_broker_recv_stream (s_broker_t *self)
+{
+    zframe_t *routing_id = zframe_recv (self->stream);
+    zframe_t *data = routing_id? zframe_recv (self->stream): NULL;
+    if (!data) {
+        zframe_destroy (&routing_id);
+        return;                     //  Interrupted
+    }
+    char *key = zframe_strhex (routing_id);
+    s_session_t *session = (s_session_t *) zhashx_lookup (self->sessions, key);
+    if (zframe_size (data) == 0) {
+        //  Connection was opened or closed, session starts with first data
+        if (session)
+            zhashx_delete (self->sessions, key);
+    }
+    else {
+        if (!session) {
+            session = s_session_new (routing_id);
+            zhashx_insert (self->sessions, key, session);
+        }
+        if (s_session_input (self, session, data) == -1) {
+            //  Empty frame closes connection
+            zframe_t *empty = zframe_new_empty ();
+            s_session_send (self, session, &empty);
+            zhashx_delete (self->sessions, key);
+        }
+    }
+    zstr_free (&key);
+    zframe_destroy (&routing_id);
+    zframe_destroy (&data);
+}
+
+
+static void
+s_broker_recv_api (s_broker_t *self)
+{
+    char *command = zstr_recv (self->pipe);
+    if (!command)
+        self->terminated = true;    //  Interrupted
+    else
+    if (streq (command, "VERBOSE"))
+        self->verbose = true;
+    else
+    if (streq (command, "$TERM"))
+        self->terminated = true;
+    else
+        zsys_error ("zmosq_broker: invalid command '%s'", command);
+    zstr_free (&command);
+}
+
+
+//  Actor binds to endpoint passed in args and sends the endpoint it's bound
+//  to, or empty string if it can't bind, on the pipe
+
+static void
+s_broker_actor (zsock_t *pipe, void *args)
+{
+    s_broker_t self;
+    memset (&self, 0, sizeof (self));
+    self.pipe = pipe;
+    self.stream = zsock_new (ZMQ_STREAM);
+    self.sessions = zhashx_new ();
+    self.retained = zhashx_new ();
+    assert (self.stream && self.sessions && self.retained);
+    zhashx_set_destructor (self.sessions, s_session_free);
+    zhashx_set_destructor (self.retained, s_retained_free);
+    //  Never drop packets to slow clients
+    zsock_set_sndhwm (self.stream, 0);
+
+    zsock_signal (pipe, 0);
+    if (zsock_bind (self.stream, "%s", (const char *) args) == -1) {
+        zstr_send (pipe, "");
+        self.terminated = true;
+    }
+    else {
+        char *endpoint = zsock_last_endpoint (self.stream);
+        zstr_send (pipe, endpoint);
+        zstr_free (&endpoint);
+    }
+
+    zpoller_t *poller = zpoller_new (pipe, self.stream, NULL);
+    assert (poller);
+    while (!self.terminated) {
+        void *which = zpoller_wait (poller, -1);
+        if (which == pipe)
+            s_broker_recv_api (&self);
+        else
+        if (which == self.stream)
+            s_broker_recv_stream (&self);
+        else
+            break;                  //  Interrupted
+    }
+    zpoller_destroy (&poller);
+    zhashx_destroy (&self.sessions);
+    zhashx_destroy (&self.retained);
+    zsock_destroy (&self.stream);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new broker listening on endpoint
+
+zmosq_broker_t *
+zmosq_broker_new (const char *endpoint)
+{
+    assert (endpoint);
+    zmosq_broker_t *self = (zmosq_broker_t *) zmalloc (sizeof (zmosq_broker_t));
+    assert (self);
+    self->actor = zactor_new (s_broker_actor, (void *) endpoint);
+    if (self->actor)
+        self->endpoint = zstr_recv (self->actor);
+    if (!self->endpoint || !*self->endpoint) {
+        zmosq_broker_destroy (&self);
+        return NULL;
+    }
+    const char *port = strrchr (self->endpoint, ':');
+    if (strncmp (self->endpoint, "tcp://", 6) == 0 && port)
+        self->port = atoi (port + 1);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the broker
+
+void
+zmosq_broker_destroy (zmosq_broker_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zmosq_broker_t *self = *self_p;
+        zactor_destroy (&self->actor);
+        zstr_free (&self->endpoint);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return endpoint broker is bound to
+
+const char *
+zmosq_broker_endpoint (zmosq_broker_t *self)
+{
+    assert (self);
+    return self->endpoint;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return TCP port broker listens on, 0 if endpoint is not TCP
+
+int
+zmosq_broker_port (zmosq_broker_t *self)
+{
+    assert (self);
+    return self->port;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Log MQTT packets handled by the broker
+
+void
+zmosq_broker_set_verbose (zmosq_broker_t *self)
+{
+    assert (self);
+    zstr_send (self->actor, "VERBOSE");
+}
+
+
+//  --------------------------------------------------------------------------
+//  Initialize mosquitto library on first use in process, every call must
+//  be paired with zmosq_broker_mosquitto_term
+
+void
+zmosq_broker_mosquitto_init (void)
+{
+    s_mosquitto_lock ();
+    if (s_mosquitto_refs == 0) {
+        int r = mosquitto_lib_init ();
+        if (r != MOSQ_ERR_SUCCESS) {
+            zsys_error ("Cannot initialize mosquitto library: %s", mosquitto_strerror (r));
+            exit (EXIT_FAILURE);
+        }
+    }
+    s_mosquitto_refs++;
+    s_mosquitto_unlock ();
+}
+
+
+//  --------------------------------------------------------------------------
+//  Clean mosquitto library up once the last user is gone
+
+void
+zmosq_broker_mosquitto_term (void)
+{
+    s_mosquitto_lock ();
+    assert (s_mosquitto_refs > 0);
+    if (--s_mosquitto_refs == 0)
+        mosquitto_lib_cleanup ();
+    s_mosquitto_unlock ();
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+typedef struct {
+    int connected;
+    int subscribed;
+    int granted;
+    int messages;
+    int retained;
+    int published;
+} s_test_state_t;
+
+static void
+s_test_connect (struct mosquitto *mosq, void *obj, int result)
+{
+    assert (result == 0);
+    ((s_test_state_t *) obj)->connected++;
+}
+
+static void
+s_test_subscribe (struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted)
+{
+    s_test_state_t *state = (s_test_state_t *) obj;
+    state->subscribed++;
+    state->granted = granted [0];
+}
+
+static void
+s_test_message (struct mosquitto *mosq, void *obj, const struct mosquitto_message *message)
+{
+    s_test_state_t *state = (s_test_state_t *) obj;
+    state->messages++;
+    if (message->retain)
+        state->retained++;
+}
+
+static void
+s_test_publish (struct mosquitto *mosq, void *obj, int mid)
+{
+    ((s_test_state_t *) obj)->published++;
+}
+
+static struct mosquitto *
+s_test_client (const char *id, int port, s_test_state_t *state)
+{
+    struct mosquitto *mosq = mosquitto_new (id, true, state);
+    assert (mosq);
+    mosquitto_connect_callback_set (mosq, s_test_connect);
+    mosquitto_subscribe_callback_set (mosq, s_test_subscribe);
+    mosquitto_message_callback_set (mosq, s_test_message);
+    mosquitto_publish_callback_set (mosq, s_test_publish);
+    int rc = mosquitto_connect (mosq, "127.0.0.1", port, 10);
+    assert (rc == MOSQ_ERR_SUCCESS);
+    return mosq;
+}
+
+//  Run network loops of both clients until value gets to wanted
+static void
+s_test_loop (struct mosquitto *first, struct mosquitto *second, int *value, int wanted)
+{
+    int64_t until = zclock_mono () + 5000;
+    while (*value < wanted && zclock_mono () < until) {
+        mosquitto_loop (first, 10, 1);
+        mosquitto_loop (second, 10, 1);
+    }
+    assert (*value == wanted);
+}
+
+void
+zmosq_broker_test (bool verbose)
+{
+    printf (" * zmosq_broker: ");
+    if (verbose)
+        printf ("\n");
+
+    //  @selftest
+    zmosq_broker_t *broker = zmosq_broker_new ("tcp://127.0.0.1:*");
+    assert (broker);
+    assert (zmosq_broker_port (broker) > 0);
+    if (verbose)
+        zmosq_broker_set_verbose (broker);
+    assert (zmosq_broker_new ("nonsense://") == NULL);
+
+    zmosq_broker_mosquitto_init ();
+    s_test_state_t pub_state, sub_state;
+    memset (&pub_state, 0, sizeof (pub_state));
+    memset (&sub_state, 0, sizeof (sub_state));
+    struct mosquitto *publisher = s_test_client ("publisher", zmosq_broker_port (broker), &pub_state);
+    struct mosquitto *subscriber = s_test_client ("subscriber", zmosq_broker_port (broker), &sub_state);
+    s_test_loop (publisher, subscriber, &pub_state.connected, 1);
+    s_test_loop (publisher, subscriber, &sub_state.connected, 1);
+
+    //  Retained message comes to later subscriber
+    int rc = mosquitto_publish (publisher, NULL, "test/retained", 1, "R", 1, true);
+    assert (rc == MOSQ_ERR_SUCCESS);
+    s_test_loop (publisher, subscriber, &pub_state.published, 1);
+    rc = mosquitto_subscribe (subscriber, NULL, "test/#", 2);
+    assert (rc == MOSQ_ERR_SUCCESS);
+    s_test_loop (publisher, subscriber, &sub_state.subscribed, 1);
+    assert (sub_state.granted == 2);
+    s_test_loop (publisher, subscriber, &sub_state.retained, 1);
+
+    //  Every QoS is acknowledged and delivered
+    int qos;
+    for (qos = 0; qos <= 2; qos++) {
+        rc = mosquitto_publish (publisher, NULL, "test/qos", 5, "HELLO", qos, false);
+        assert (rc == MOSQ_ERR_SUCCESS);
+    }
+    s_test_loop (publisher, subscriber, &pub_state.published, 4);
+    s_test_loop (publisher, subscriber, &sub_state.messages, 4);
+    assert (sub_state.retained == 1);
+
+    //  Other topics and unsubscribed topics are not delivered
+    rc = mosquitto_publish (publisher, NULL, "other", 5, "HELLO", 0, false);
+    assert (rc == MOSQ_ERR_SUCCESS);
+    rc = mosquitto_unsubscribe (subscriber, NULL, "test/#");
+    assert (rc == MOSQ_ERR_SUCCESS);
+    int64_t until = zclock_mono () + 100;
+    while (zclock_mono () < until) {
+        mosquitto_loop (publisher, 10, 1);
+        mosquitto_loop (subscriber, 10, 1);
+    }
+    rc = mosquitto_publish (publisher, NULL, "test/qos", 5, "HELLO", 0, false);
+    assert (rc == MOSQ_ERR_SUCCESS);
+    s_test_loop (publisher, subscriber, &pub_state.published, 6);
+    until = zclock_mono () + 100;
+    while (zclock_mono () < until) {
+        mosquitto_loop (publisher, 10, 1);
+        mosquitto_loop (subscriber, 10, 1);
+    }
+    assert (sub_state.messages == 4);
+
+    mosquitto_destroy (publisher);
+    mosquitto_destroy (subscriber);
+    zmosq_broker_mosquitto_term ();
+    zmosq_broker_destroy (&broker);
+    //  @end
+    printf ("OK\n");
+}
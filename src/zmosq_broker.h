@@ -0,0 +1,60 @@
+/*  =========================================================================
+    zmosq_broker - Embedded MQTT broker stand-in
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.
+    This file is part of the Malamute Project.
+
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.
+    =========================================================================
+*/
+
+#ifndef ZMOSQ_BROKER_H_INCLUDED
+#define ZMOSQ_BROKER_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new broker listening on zeromq endpoint, like
+//  "tcp://127.0.0.1:*". Return NULL if endpoint can't be bound.
+ZMSQ_PRIVATE zmosq_broker_t *
+    zmosq_broker_new (const char *endpoint);
+
+//  Destroy the broker, all client connections are closed
+ZMSQ_PRIVATE void
+    zmosq_broker_destroy (zmosq_broker_t **self_p);
+
+//  Return endpoint broker is bound to, with port resolved
+ZMSQ_PRIVATE const char *
+    zmosq_broker_endpoint (zmosq_broker_t *self);
+
+//  Return TCP port broker listens on, 0 if endpoint is not TCP
+ZMSQ_PRIVATE int
+    zmosq_broker_port (zmosq_broker_t *self);
+
+//  Log MQTT packets handled by the broker
+ZMSQ_PRIVATE void
+    zmosq_broker_set_verbose (zmosq_broker_t *self);
+
+//  Initialize mosquitto library on first use in process, every call
+//  must be paired with zmosq_broker_mosquitto_term
+ZMSQ_PRIVATE void
+    zmosq_broker_mosquitto_init (void);
+
+//  Clean mosquitto library up once the last user is gone
+ZMSQ_PRIVATE void
+    zmosq_broker_mosquitto_term (void);
+
+//  Self test of this class
+ZMSQ_PRIVATE void
+    zmosq_broker_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -264,7 +264,7 @@ zmosq_client_mlm_set_stream (zmosq_client_t *self, const char *stream)
     assert (self);
     assert (stream);
 
-    zstr_sendx (self->zmosq_server, "MLM-PUBLISH", "stream", NULL);
+    zstr_sendx (self->zmosq_server, "MLM-PUBLISH", stream, NULL);
     zstr_free (&self->mlm_stream);
     self->mlm_stream = strdup (stream);
 }
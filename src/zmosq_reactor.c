@@ -0,0 +1,623 @@
+/*  =========================================================================
+    zmosq_reactor - Network loop shared by many mosquitto clients
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+    This file is part of the Malamute Project.                         
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+/*
+@header
+    zmosq_reactor - Network loop shared by many mosquitto clients
+@discuss
+Instead of a mosquitto_loop_start thread per client, a small fixed pool
+of threads services sockets of all clients. Each thread owns an epoll set
+and the clients assigned to it, it calls mosquitto_loop_read/write/misc
+as the sockets become ready and reconnects lost clients.
+
+Clients are assigned to the least loaded thread and stay there, so all
+callbacks of one client come from one thread.
+@end
+*/
+
+#include "zmsq_classes.h"
+
+#if defined (__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+typedef struct _s_worker_t s_worker_t;
+
+//  Client driven by the reactor
+
+typedef struct {
+    struct mosquitto *mosq;     //  The client
+    s_worker_t *worker;         //  Thread servicing the client
+    SOCKET socket;              //  Socket in epoll set or INVALID_SOCKET
+    bool want_write;            //  Socket polled for output as well?
+    int64_t misc_at;            //  Time of next mosquitto_loop_misc
+    int64_t reconnect_at;       //  Time of next reconnect, 0 = not lost
+    int reconnect_min;          //  Reconnect backoff, msecs
+    int reconnect_max;
+    size_t attempts;            //  Reconnects since broker last answered
+    bool removed;               //  Worker does not use client anymore
+} s_client_t;
+
+//  Reactor thread
+
+struct _s_worker_t {
+    pthread_t thread;           //  Our thread
+    int epoll;                  //  epoll set of client sockets and wakeup
+    int wakeup;                 //  eventfd to wake thread up for control
+    pthread_mutex_t mutex;      //  Guards members below
+    pthread_cond_t removed;     //  Signals clients were removed
+    zlistx_t *adding;           //  Clients to be added by thread
+    zlistx_t *removing;         //  Clients to be removed by thread
+    size_t size;                //  Clients assigned to this thread
+    bool terminated;            //  Thread shall quit
+    zlistx_t *clients;          //  Clients serviced, used by thread only
+};
+
+//  Structure of our class
+
+struct _zmosq_reactor_t {
+    s_worker_t *workers;        //  Reactor threads
+    size_t threads;             //  Number of workers
+    pthread_mutex_t mutex;      //  Guards clients
+    zhashx_t *clients;          //  Registered clients, by mosq
+};
+
+#define S_TICK 100              //  Msecs between checks of client timers
+
+
+//  --------------------------------------------------------------------------
+//  Worker: (re)register socket of the client in epoll set
+
+static void
+s_client_watch (s_client_t *client)
+{
+    SOCKET socket = mosquitto_socket (client->mosq);
+    bool want_write = socket != INVALID_SOCKET && mosquitto_want_write (client->mosq);
+    if (socket == client->socket && want_write == client->want_write)
+        return;
+
+    struct epoll_event event;
+    memset (&event, 0, sizeof (event));
+    event.data.ptr = client;
+    event.events = EPOLLIN | (want_write? EPOLLOUT: 0);
+
+    if (socket != client->socket) {
+        //  Closed sockets are dropped from the set by kernel, errors are fine
+        if (client->socket != INVALID_SOCKET)
+            epoll_ctl (client->worker->epoll, EPOLL_CTL_DEL, client->socket, NULL);
+        if (socket != INVALID_SOCKET
+        &&  epoll_ctl (client->worker->epoll, EPOLL_CTL_ADD, socket, &event) == -1)
+            socket = INVALID_SOCKET;
+    }
+    else
+        epoll_ctl (client->worker->epoll, EPOLL_CTL_MOD, socket, &event);
+
+    client->socket = socket;
+    client->want_write = socket != INVALID_SOCKET && want_write;
+}
+
+
+//  Worker: client lost connection, try again after backoff
+
+static void
+s_client_lost (s_client_t *client, int64_t now)
+{
+    if (client->socket != INVALID_SOCKET)
+        epoll_ctl (client->worker->epoll, EPOLL_CTL_DEL, client->socket, NULL);
+    client->socket = INVALID_SOCKET;
+    client->want_write = false;
+    client->reconnect_at = now + zmosq_reactor_backoff (
+        client->reconnect_min, client->reconnect_max, client->attempts++);
+}
+
+
+//  Worker: service client after poll, events are epoll events on its socket
+
+static void
+s_client_service (s_client_t *client, uint32_t events, int64_t now)
+{
+    if (client->socket == INVALID_SOCKET) {
+        if (client->reconnect_at && now >= client->reconnect_at) {
+            if (mosquitto_reconnect_async (client->mosq) == MOSQ_ERR_SUCCESS) {
+                client->reconnect_at = 0;
+                client->misc_at = now + 1000;
+                s_client_watch (client);
+            }
+            else
+                client->reconnect_at = now + zmosq_reactor_backoff (
+                    client->reconnect_min, client->reconnect_max, client->attempts++);
+        }
+        return;
+    }
+
+    int r = MOSQ_ERR_SUCCESS;
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        r = mosquitto_loop_read (client->mosq, 1);
+        //  First packet from broker is CONNACK, refused one fails the read
+        if (r == MOSQ_ERR_SUCCESS && (events & EPOLLIN))
+            client->attempts = 0;
+    }
+    if (r == MOSQ_ERR_SUCCESS && mosquitto_want_write (client->mosq))
+        r = mosquitto_loop_write (client->mosq, 1);
+    if (r == MOSQ_ERR_SUCCESS && now >= client->misc_at) {
+        r = mosquitto_loop_misc (client->mosq);
+        client->misc_at = now + 1000;
+    }
+    if (r == MOSQ_ERR_SUCCESS)
+        s_client_watch (client);
+    else
+        s_client_lost (client, now);
+}
+
+
+//  Worker: take clients added and removed by other threads
+
+static void
+s_worker_control (s_worker_t *self)
+{
+    uint64_t count;
+    if (read (self->wakeup, &count, sizeof (count)) == -1)
+        count = 0;              //  Nothing pending, eventfd is non-blocking
+
+    pthread_mutex_lock (&self->mutex);
+    s_client_t *client = (s_client_t *) zlistx_first (self->adding);
+    while (client) {
+        zlistx_add_end (self->clients, client);
+        client->misc_at = zclock_mono () + 1000;
+        s_client_watch (client);
+        client = (s_client_t *) zlistx_next (self->adding);
+    }
+    zlistx_purge (self->adding);
+
+    client = (s_client_t *) zlistx_first (self->removing);
+    while (client) {
+        if (client->socket != INVALID_SOCKET)
+            epoll_ctl (self->epoll, EPOLL_CTL_DEL, client->socket, NULL);
+        void *handle = zlistx_find (self->clients, client);
+        if (handle)
+            zlistx_detach (self->clients, handle);
+        client->removed = true;
+        client = (s_client_t *) zlistx_next (self->removing);
+    }
+    if (zlistx_size (self->removing)) {
+        zlistx_purge (self->removing);
+        pthread_cond_broadcast (&self->removed);
+    }
+    pthread_mutex_unlock (&self->mutex);
+}
+
+
+//  Worker thread, services sockets until terminated
+
+static void *
+s_worker_run (void *args)
+{
+    s_worker_t *self = (s_worker_t *) args;
+    struct epoll_event events [64];
+    int64_t tick_at = zclock_mono () + S_TICK;
+
+    while (true) {
+        int64_t now = zclock_mono ();
+        int timeout = tick_at > now? (int) (tick_at - now): 0;
+        int rc = epoll_wait (self->epoll, events, 64, timeout);
+        now = zclock_mono ();
+
+        //  Control goes last, removed clients may still have events here
+        bool control = false;
+        int index;
+        for (index = 0; index < rc; index++) {
+            if (events [index].data.ptr == NULL)
+                control = true;
+            else
+                s_client_service (
+                    (s_client_t *) events [index].data.ptr, events [index].events, now);
+        }
+        if (control)
+            s_worker_control (self);
+
+        pthread_mutex_lock (&self->mutex);
+        bool terminated = self->terminated;
+        pthread_mutex_unlock (&self->mutex);
+        if (terminated)
+            break;
+
+        if (now >= tick_at) {
+            s_client_t *client = (s_client_t *) zlistx_first (self->clients);
+            while (client) {
+                s_client_service (client, 0, now);
+                client = (s_client_t *) zlistx_next (self->clients);
+            }
+            tick_at = now + S_TICK;
+        }
+    }
+    return NULL;
+}
+
+
+//  Wake worker thread up to process control requests
+
+static void
+s_worker_wakeup (s_worker_t *self)
+{
+    uint64_t one = 1;
+    if (write (self->wakeup, &one, sizeof (one)) == -1)
+        zsys_error ("zmosq_reactor: can't wake up worker: %s", strerror (errno));
+}
+
+
+static size_t
+s_mosq_hash (const void *key)
+{
+    return (size_t) key;
+}
+
+static int
+s_mosq_compare (const void *key1, const void *key2)
+{
+    return key1 < key2? -1: key1 > key2? 1: 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new reactor with given number of threads. Return NULL if the
+//  platform has no reactor (needs epoll).
+
+zmosq_reactor_t *
+zmosq_reactor_new (size_t threads)
+{
+    zmosq_reactor_t *self = (zmosq_reactor_t *) zmalloc (sizeof (zmosq_reactor_t));
+    if (!self)
+        return NULL;
+    if (threads < 1)
+        threads = 1;
+
+    pthread_mutex_init (&self->mutex, NULL);
+    self->clients = zhashx_new ();
+    self->workers = (s_worker_t *) zmalloc (threads * sizeof (s_worker_t));
+    if (!self->clients || !self->workers) {
+        zmosq_reactor_destroy (&self);
+        return NULL;
+    }
+    zhashx_set_key_hasher (self->clients, s_mosq_hash);
+    zhashx_set_key_comparator (self->clients, s_mosq_compare);
+    zhashx_set_key_duplicator (self->clients, NULL);
+    zhashx_set_key_destructor (self->clients, NULL);
+
+    for (self->threads = 0; self->threads < threads; self->threads++) {
+        s_worker_t *worker = &self->workers [self->threads];
+        worker->epoll = epoll_create1 (EPOLL_CLOEXEC);
+        worker->wakeup = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        worker->adding = zlistx_new ();
+        worker->removing = zlistx_new ();
+        worker->clients = zlistx_new ();
+        pthread_mutex_init (&worker->mutex, NULL);
+        pthread_cond_init (&worker->removed, NULL);
+
+        struct epoll_event event;
+        memset (&event, 0, sizeof (event));
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        if (worker->epoll == -1 || worker->wakeup == -1
+        ||  !worker->adding || !worker->removing || !worker->clients
+        ||  epoll_ctl (worker->epoll, EPOLL_CTL_ADD, worker->wakeup, &event) == -1
+        ||  pthread_create (&worker->thread, NULL, s_worker_run, worker)) {
+            self->threads++;    //  Destroy cleans up this one too
+            worker->terminated = true;
+            zmosq_reactor_destroy (&self);
+            return NULL;
+        }
+    }
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the reactor, all clients must be removed before
+
+void
+zmosq_reactor_destroy (zmosq_reactor_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zmosq_reactor_t *self = *self_p;
+        size_t index;
+        for (index = 0; index < self->threads; index++) {
+            s_worker_t *worker = &self->workers [index];
+            pthread_mutex_lock (&worker->mutex);
+            bool running = !worker->terminated;
+            worker->terminated = true;
+            pthread_mutex_unlock (&worker->mutex);
+            if (running) {
+                s_worker_wakeup (worker);
+                pthread_join (worker->thread, NULL);
+            }
+            if (worker->epoll != -1)
+                close (worker->epoll);
+            if (worker->wakeup != -1)
+                close (worker->wakeup);
+            zlistx_destroy (&worker->adding);
+            zlistx_destroy (&worker->removing);
+            zlistx_destroy (&worker->clients);
+            pthread_mutex_destroy (&worker->mutex);
+            pthread_cond_destroy (&worker->removed);
+        }
+        free (self->workers);
+        if (self->clients) {
+            assert (zhashx_size (self->clients) == 0);
+            zhashx_destroy (&self->clients);
+        }
+        pthread_mutex_destroy (&self->mutex);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Let reactor drive network loop of mosquitto client, connect must have
+//  been called on the client already. Lost connection is re-established
+//  with backoff from reconnect_min to reconnect_max msecs. Return 0 if OK,
+//  else -1.
+
+int
+zmosq_reactor_add (zmosq_reactor_t *self, struct mosquitto *mosq, int reconnect_min, int reconnect_max)
+{
+    assert (self);
+    assert (mosq);
+
+    pthread_mutex_lock (&self->mutex);
+    if (zhashx_lookup (self->clients, mosq)) {
+        pthread_mutex_unlock (&self->mutex);
+        return 0;
+    }
+    s_client_t *client = (s_client_t *) zmalloc (sizeof (s_client_t));
+    if (!client) {
+        pthread_mutex_unlock (&self->mutex);
+        return -1;
+    }
+    client->mosq = mosq;
+    client->socket = INVALID_SOCKET;
+    client->reconnect_min = reconnect_min;
+    client->reconnect_max = reconnect_max;
+    zhashx_insert (self->clients, mosq, client);
+
+    //  Least loaded thread gets the client
+    s_worker_t *worker = &self->workers [0];
+    size_t index;
+    for (index = 1; index < self->threads; index++)
+        if (self->workers [index].size < worker->size)
+            worker = &self->workers [index];
+    client->worker = worker;
+
+    pthread_mutex_lock (&worker->mutex);
+    worker->size++;
+    zlistx_add_end (worker->adding, client);
+    pthread_mutex_unlock (&worker->mutex);
+    pthread_mutex_unlock (&self->mutex);
+
+    s_worker_wakeup (worker);
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Stop driving network loop of mosquitto client. Waits up to timeout
+//  msecs for reactor thread to let go of the client. Return 0 when client
+//  is removed, -1 when reactor thread still uses it, then call again later.
+//  Client must be removed by the thread which added it.
+
+int
+zmosq_reactor_remove (zmosq_reactor_t *self, struct mosquitto *mosq, int timeout)
+{
+    assert (self);
+    assert (mosq);
+
+    pthread_mutex_lock (&self->mutex);
+    s_client_t *client = (s_client_t *) zhashx_lookup (self->clients, mosq);
+    if (!client) {
+        pthread_mutex_unlock (&self->mutex);
+        return 0;
+    }
+    s_worker_t *worker = client->worker;
+    pthread_mutex_lock (&worker->mutex);
+    if (!zlistx_find (worker->removing, client)) {
+        //  Client may still wait to be added
+        void *handle = zlistx_find (worker->adding, client);
+        if (handle) {
+            zlistx_detach (worker->adding, handle);
+            client->removed = true;
+        }
+        else
+        if (!client->removed) {
+            zlistx_add_end (worker->removing, client);
+            s_worker_wakeup (worker);
+        }
+    }
+    //  Don't hold reactor lock while waiting, other clients are added and
+    //  removed meanwhile. Only the owner removes a client, so it's safe.
+    pthread_mutex_unlock (&self->mutex);
+
+    struct timespec deadline;
+    clock_gettime (CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (!client->removed) {
+        if (pthread_cond_timedwait (&worker->removed, &worker->mutex, &deadline))
+            break;
+    }
+    bool removed = client->removed;
+    if (removed)
+        worker->size--;
+    pthread_mutex_unlock (&worker->mutex);
+
+    if (removed) {
+        pthread_mutex_lock (&self->mutex);
+        zhashx_delete (self->clients, mosq);
+        pthread_mutex_unlock (&self->mutex);
+        free (client);
+    }
+    return removed? 0: -1;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return number of clients driven by reactor
+
+size_t
+zmosq_reactor_size (zmosq_reactor_t *self)
+{
+    assert (self);
+    pthread_mutex_lock (&self->mutex);
+    size_t size = zhashx_size (self->clients);
+    pthread_mutex_unlock (&self->mutex);
+    return size;
+}
+
+#else
+
+//  No epoll, callers fall back to a mosquitto thread per client
+
+zmosq_reactor_t *
+zmosq_reactor_new (size_t threads)
+{
+    return NULL;
+}
+
+void
+zmosq_reactor_destroy (zmosq_reactor_t **self_p)
+{
+    assert (self_p);
+}
+
+int
+zmosq_reactor_add (zmosq_reactor_t *self, struct mosquitto *mosq, int reconnect_min, int reconnect_max)
+{
+    return -1;
+}
+
+int
+zmosq_reactor_remove (zmosq_reactor_t *self, struct mosquitto *mosq, int timeout)
+{
+    return 0;
+}
+
+size_t
+zmosq_reactor_size (zmosq_reactor_t *self)
+{
+    return 0;
+}
+
+#endif
+
+
+//  --------------------------------------------------------------------------
+//  Return msecs to wait before reconnect attempt (counted from 0): delay
+//  doubles from min up to max with each attempt, and a random part of up
+//  to half of it is taken off.
+
+int
+zmosq_reactor_backoff (int min, int max, size_t attempt)
+{
+    if (min < 1)
+        min = 1;
+    if (max < min)
+        max = min;
+    int delay = min;
+    while (attempt-- && delay < max)
+        delay = delay > max / 2? max: delay * 2;
+    return delay - randof (delay / 2 + 1);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+void
+zmosq_reactor_test (bool verbose)
+{
+    printf (" * zmosq_reactor: ");
+
+    //  @selftest
+    //  Backoff grows up to max, jitter takes off at most half of it
+    size_t attempt;
+    for (attempt = 0; attempt < 10; attempt++) {
+        int delay = zmosq_reactor_backoff (100, 1000, attempt);
+        int ceiling = attempt < 4? 100 << attempt: 1000;
+        assert (delay <= ceiling && delay >= ceiling / 2);
+    }
+    assert (zmosq_reactor_backoff (0, 0, 5) == 1);
+
+#if defined (__linux__)
+    mosquitto_lib_init ();
+
+    //  Plain TCP listener stands in for the broker, we only check reactor
+    //  writes CONNECT packet queued by mosquitto_connect_bind_async
+    int listener = socket (AF_INET, SOCK_STREAM, 0);
+    assert (listener != -1);
+    struct sockaddr_in address;
+    memset (&address, 0, sizeof (address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    int rc = bind (listener, (struct sockaddr *) &address, sizeof (address));
+    assert (rc == 0);
+    rc = listen (listener, 8);
+    assert (rc == 0);
+    socklen_t address_len = sizeof (address);
+    rc = getsockname (listener, (struct sockaddr *) &address, &address_len);
+    assert (rc == 0);
+
+    zmosq_reactor_t *reactor = zmosq_reactor_new (2);
+    assert (reactor);
+
+    struct mosquitto *clients [4];
+    int index;
+    for (index = 0; index < 4; index++) {
+        clients [index] = mosquitto_new (NULL, true, NULL);
+        assert (clients [index]);
+        rc = mosquitto_connect_bind_async (
+            clients [index], "127.0.0.1", ntohs (address.sin_port), 60, NULL);
+        assert (rc == MOSQ_ERR_SUCCESS);
+        rc = zmosq_reactor_add (reactor, clients [index], 1000, 1000);
+        assert (rc == 0);
+    }
+    assert (zmosq_reactor_size (reactor) == 4);
+
+    for (index = 0; index < 4; index++) {
+        int peer = accept (listener, NULL, NULL);
+        assert (peer != -1);
+        struct timeval timeout = { 5, 0 };
+        setsockopt (peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+        unsigned char header;
+        rc = recv (peer, &header, 1, 0);
+        assert (rc == 1);
+        assert (header == 0x10);    //  CONNECT
+        close (peer);
+    }
+
+    for (index = 0; index < 4; index++) {
+        rc = zmosq_reactor_remove (reactor, clients [index], 1000);
+        assert (rc == 0);
+        mosquitto_destroy (clients [index]);
+    }
+    assert (zmosq_reactor_size (reactor) == 0);
+    zmosq_reactor_destroy (&reactor);
+    close (listener);
+    mosquitto_lib_cleanup ();
+#endif
+    //  @end
+
+    printf ("OK\n");
+}
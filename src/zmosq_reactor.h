@@ -0,0 +1,66 @@
+/*  =========================================================================
+    zmosq_reactor - Network loop shared by many mosquitto clients
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+    This file is part of the Malamute Project.                         
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+#ifndef ZMOSQ_REACTOR_H_INCLUDED
+#define ZMOSQ_REACTOR_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new reactor with given number of threads. Return NULL if the
+//  platform has no reactor (needs epoll).
+ZMSQ_PRIVATE zmosq_reactor_t *
+    zmosq_reactor_new (size_t threads);
+
+//  Destroy the reactor, all clients must be removed before
+ZMSQ_PRIVATE void
+    zmosq_reactor_destroy (zmosq_reactor_t **self_p);
+
+//  Let reactor drive network loop of mosquitto client, connect must have
+//  been called on the client already. Callbacks of the client are called
+//  from reactor thread, always the same one. Lost connection is
+//  re-established after zmosq_reactor_backoff msecs, growing from
+//  reconnect_min to reconnect_max while attempts fail. Return 0 if OK,
+//  else -1.
+ZMSQ_PRIVATE int
+    zmosq_reactor_add (zmosq_reactor_t *self, struct mosquitto *mosq, int reconnect_min, int reconnect_max);
+
+//  Stop driving network loop of mosquitto client. Waits up to timeout
+//  msecs for reactor thread to let go of the client. Return 0 when client
+//  is removed, -1 when reactor thread still uses it (e.g. is blocked in a
+//  callback), then call again later.
+ZMSQ_PRIVATE int
+    zmosq_reactor_remove (zmosq_reactor_t *self, struct mosquitto *mosq, int timeout);
+
+//  Return number of clients driven by reactor
+ZMSQ_PRIVATE size_t
+    zmosq_reactor_size (zmosq_reactor_t *self);
+
+//  Return msecs to wait before reconnect attempt (counted from 0): delay
+//  doubles from min up to max with each attempt, and a random part of up
+//  to half of it is taken off, so clients which lost the same broker do
+//  not come back all at once.
+ZMSQ_PRIVATE int
+    zmosq_reactor_backoff (int min, int max, size_t attempt);
+
+//  Self test of this class
+ZMSQ_PRIVATE void
+    zmosq_reactor_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,256 @@
+/*  =========================================================================
+    zmosq_ring - Bounded single-producer/single-consumer ring
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+    This file is part of the Malamute Project.                         
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+/*
+@header
+    zmosq_ring - Bounded single-producer/single-consumer ring
+@discuss
+Lock-free queue of pointers between exactly one producer thread and one
+consumer thread. Producer and consumer indexes live on their own cache
+lines, so the only shared writes are the index updates.
+
+Consumer calls zmosq_ring_sleep before it blocks waiting for new items;
+producer is then told by zmosq_ring_push to wake it up. While consumer is
+draining the ring, pushes need no signalling at all.
+@end
+*/
+
+#include "zmsq_classes.h"
+#include "zmosq_atomic.h"
+
+#define ZMOSQ_RING_CACHE_LINE 64
+
+//  Structure of our class
+
+struct _zmosq_ring_t {
+    void **items;               //  Slots, capacity is power of two
+    size_t mask;                //  capacity - 1
+    char pad1 [ZMOSQ_RING_CACHE_LINE];
+    size_t head;                //  Next slot to pop, written by consumer
+    char pad2 [ZMOSQ_RING_CACHE_LINE];
+    size_t tail;                //  Next slot to push, written by producer
+    char pad3 [ZMOSQ_RING_CACHE_LINE];
+    size_t sleeping;            //  Consumer waits for a wake-up
+};
+
+
+//  --------------------------------------------------------------------------
+//  Create a new ring holding at least size items
+
+zmosq_ring_t *
+zmosq_ring_new (size_t size)
+{
+    zmosq_ring_t *self = (zmosq_ring_t *) zmalloc (sizeof (zmosq_ring_t));
+    if (!self)
+        return NULL;
+
+    size_t capacity = 2;
+    while (capacity < size)
+        capacity <<= 1;
+    self->items = (void **) zmalloc (capacity * sizeof (void *));
+    if (!self->items) {
+        zmosq_ring_destroy (&self);
+        return NULL;
+    }
+    self->mask = capacity - 1;
+    self->sleeping = 1;
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the ring, items still queued are not touched
+
+void
+zmosq_ring_destroy (zmosq_ring_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zmosq_ring_t *self = *self_p;
+        free (self->items);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Producer side: queue item. Return 0 if queued, 1 if queued and consumer
+//  went to sleep and must be woken up, -1 if the ring is full.
+
+int
+zmosq_ring_push (zmosq_ring_t *self, void *item)
+{
+    assert (self);
+    size_t tail = self->tail;
+    if (tail - zmosq_atomic_load (&self->head, ZMOSQ_ACQUIRE) > self->mask)
+        return -1;
+
+    self->items [tail & self->mask] = item;
+    zmosq_atomic_store (&self->tail, tail + 1, ZMOSQ_RELEASE);
+
+    //  Pairs with the fence in zmosq_ring_sleep, either consumer sees the
+    //  new item, or we see it sleeping
+    zmosq_atomic_fence ();
+    if (zmosq_atomic_load (&self->sleeping, ZMOSQ_RELAXED)
+    &&  zmosq_atomic_exchange (&self->sleeping, 0))
+        return 1;
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Consumer side: take the oldest item, NULL if the ring is empty
+
+void *
+zmosq_ring_pop (zmosq_ring_t *self)
+{
+    assert (self);
+    size_t head = self->head;
+    if (head == zmosq_atomic_load (&self->tail, ZMOSQ_ACQUIRE))
+        return NULL;
+
+    void *item = self->items [head & self->mask];
+    zmosq_atomic_store (&self->head, head + 1, ZMOSQ_RELEASE);
+    return item;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Consumer side: announce consumer goes to sleep. Return true if the ring
+//  is empty and next push will ask for a wake-up, false if there are items
+//  to pop and consumer must not sleep.
+
+bool
+zmosq_ring_sleep (zmosq_ring_t *self)
+{
+    assert (self);
+    zmosq_atomic_store (&self->sleeping, 1, ZMOSQ_RELAXED);
+    zmosq_atomic_fence ();
+    if (self->head == zmosq_atomic_load (&self->tail, ZMOSQ_ACQUIRE))
+        return true;
+
+    zmosq_atomic_store (&self->sleeping, 0, ZMOSQ_RELAXED);
+    return false;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return number of queued items, exact only from producer or consumer
+
+size_t
+zmosq_ring_size (zmosq_ring_t *self)
+{
+    assert (self);
+    return zmosq_atomic_load (&self->tail, ZMOSQ_ACQUIRE)
+         - zmosq_atomic_load (&self->head, ZMOSQ_ACQUIRE);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return capacity of the ring
+
+size_t
+zmosq_ring_capacity (zmosq_ring_t *self)
+{
+    assert (self);
+    return self->mask + 1;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+#define S_TEST_ITEMS 1000000
+
+static void
+s_test_producer (zsock_t *pipe, void *args)
+{
+    zmosq_ring_t *ring = (zmosq_ring_t *) args;
+    zsock_t *wakeup = zsock_new_pair (">inproc://zmosq_ring_test");
+    assert (wakeup);
+    zsock_signal (pipe, 0);
+
+    size_t i;
+    for (i = 1; i <= S_TEST_ITEMS; i++) {
+        int rc;
+        while ((rc = zmosq_ring_push (ring, (void *) i)) == -1)
+            zclock_sleep (0);
+        if (rc == 1)
+            zstr_send (wakeup, "");
+    }
+    zsock_destroy (&wakeup);
+    //  Wait for $TERM
+    char *command = zstr_recv (pipe);
+    zstr_free (&command);
+}
+
+void
+zmosq_ring_test (bool verbose)
+{
+    printf (" * zmosq_ring: ");
+
+    //  @selftest
+    zmosq_ring_t *ring = zmosq_ring_new (3);
+    assert (ring);
+    assert (zmosq_ring_capacity (ring) == 4);
+    assert (zmosq_ring_pop (ring) == NULL);
+
+    //  First push wakes up idle consumer, the next ones do not
+    int one = 1, two = 2;
+    assert (zmosq_ring_push (ring, &one) == 1);
+    assert (zmosq_ring_push (ring, &two) == 0);
+    assert (zmosq_ring_push (ring, &two) == 0);
+    assert (zmosq_ring_push (ring, &two) == 0);
+    assert (zmosq_ring_push (ring, &two) == -1);
+    assert (zmosq_ring_size (ring) == 4);
+    assert (!zmosq_ring_sleep (ring));
+    assert (zmosq_ring_pop (ring) == &one);
+    assert (zmosq_ring_pop (ring) == &two);
+    assert (zmosq_ring_pop (ring) == &two);
+    assert (zmosq_ring_pop (ring) == &two);
+    assert (zmosq_ring_pop (ring) == NULL);
+    assert (zmosq_ring_sleep (ring));
+    assert (zmosq_ring_push (ring, &one) == 1);
+    assert (zmosq_ring_pop (ring) == &one);
+    zmosq_ring_destroy (&ring);
+
+    //  Producer and consumer in different threads, no item and no wake-up
+    //  may be lost
+    ring = zmosq_ring_new (1024);
+    zsock_t *wakeup = zsock_new_pair ("@inproc://zmosq_ring_test");
+    assert (wakeup);
+    zactor_t *producer = zactor_new (s_test_producer, ring);
+    size_t expected = 1;
+    int64_t start = zclock_usecs ();
+    while (expected <= S_TEST_ITEMS) {
+        void *item;
+        while ((item = zmosq_ring_pop (ring))) {
+            assert ((size_t) item == expected);
+            expected++;
+        }
+        if (expected <= S_TEST_ITEMS && zmosq_ring_sleep (ring)) {
+            char *signal = zstr_recv (wakeup);
+            assert (signal);
+            zstr_free (&signal);
+        }
+    }
+    if (verbose)
+        zsys_debug ("zmosq_ring: %d items passed in %d ms",
+            S_TEST_ITEMS, (int) ((zclock_usecs () - start) / 1000));
+    zactor_destroy (&producer);
+    zsock_destroy (&wakeup);
+    zmosq_ring_destroy (&ring);
+    //  @end
+
+    printf ("OK\n");
+}
@@ -0,0 +1,61 @@
+/*  =========================================================================
+    zmosq_ring - Bounded single-producer/single-consumer ring
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+    This file is part of the Malamute Project.                         
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+#ifndef ZMOSQ_RING_H_INCLUDED
+#define ZMOSQ_RING_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Create a new ring holding at least size items
+ZMSQ_PRIVATE zmosq_ring_t *
+    zmosq_ring_new (size_t size);
+
+//  Destroy the ring, items still queued are not touched
+ZMSQ_PRIVATE void
+    zmosq_ring_destroy (zmosq_ring_t **self_p);
+
+//  Producer side: queue item. Return 0 if queued, 1 if queued and consumer
+//  went to sleep and must be woken up, -1 if the ring is full.
+ZMSQ_PRIVATE int
+    zmosq_ring_push (zmosq_ring_t *self, void *item);
+
+//  Consumer side: take the oldest item, NULL if the ring is empty
+ZMSQ_PRIVATE void *
+    zmosq_ring_pop (zmosq_ring_t *self);
+
+//  Consumer side: announce consumer goes to sleep. Return true if the ring
+//  is empty and next push will ask for a wake-up, false if there are items
+//  to pop and consumer must not sleep.
+ZMSQ_PRIVATE bool
+    zmosq_ring_sleep (zmosq_ring_t *self);
+
+//  Return number of queued items, exact only from producer or consumer
+ZMSQ_PRIVATE size_t
+    zmosq_ring_size (zmosq_ring_t *self);
+
+//  Return capacity of the ring
+ZMSQ_PRIVATE size_t
+    zmosq_ring_capacity (zmosq_ring_t *self);
+
+//  Self test of this class
+ZMSQ_PRIVATE void
+    zmosq_ring_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -23,30 +23,528 @@ Each zeromq message has two frames [MQTT topic|MQTT payload]
 */
 
 #include "zmsq_classes.h"
+#include "zmosq_atomic.h"
 
 typedef struct mosquitto mosquitto_t;
 
+//  Who drives the mosquitto network loop
+typedef enum {
+    LOOP_THREAD,                //  mosquitto_loop_start thread of the actor
+    LOOP_ACTOR,                 //  actor itself, from its poller
+    LOOP_REACTOR                //  reactor shared by all actors in process
+} s_loop_t;
+
+//  What a bounded stage does when it's full
+typedef enum {
+    POLICY_BLOCK,               //  wait for room, like zeromq does on HWM
+    POLICY_DROP_OLDEST,         //  make room by dropping oldest queued message
+    POLICY_DROP_NEWEST          //  drop message which does not fit
+} s_policy_t;
+
+//  Limit of messages queued in a stage of the message flow
+typedef struct {
+    size_t max_count;           //  most messages queued, 0 = no limit
+    size_t max_bytes;           //  most bytes of content queued, 0 = no limit
+    s_policy_t policy;          //  what to do when the limit is reached
+    size_t dropped;             //  messages dropped by the actor so far
+} s_limit_t;
+
+//  STATS: log-linear histogram of latencies in usecs. Every power of two is
+//  split in 8 buckets, so values are kept with 12.5% precision, like HDR
+//  histograms do.
+#define S_HISTOGRAM_SIZE (62 * 8)
+//  STATS: one in this many commands, and messages in LOOP actor, is timed
+#define S_PROBE_INTERVAL 64
+//  Longest delay of SUBSCRIBE/UNSUBSCRIBE changes to live sessions, in msecs
+#define S_SUBSCRIPTIONS_DELAY 10
+typedef struct {
+    uint64_t counts [S_HISTOGRAM_SIZE];
+    uint64_t count;             //  values recorded
+    uint64_t max;               //  largest value recorded
+} s_histogram_t;
+
+//  MQTT topic filter the actor subscribes to
+typedef struct {
+    char *name;                 //  Topic filter
+    int qos;                    //  QoS asked for
+    int granted;                //  QoS granted by broker, -1 = not yet, 128 = refused
+    bool sent;                  //  Was SUBSCRIBE sent for it?
+    bool pending;               //  SUBSCRIBE to be sent to live session
+} s_topic_t;
+
+//  SUBSCRIBE or UNSUBSCRIBE packet waiting for SUBACK or UNSUBACK
+typedef struct {
+    int mid;                    //  Packet id
+    zlistx_t *topics;           //  Names of topics in the packet, in order
+} s_packet_t;
+
+//  mosquitto_(un)subscribe_multiple came with libmosquitto 1.6
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1006000
+#   define S_SUBSCRIBE_MULTIPLE true
+#else
+#   define S_SUBSCRIBE_MULTIPLE false
+#endif
+
+//  Reactor is shared by all actors in process
+#if defined (__UNIX__)
+static pthread_mutex_t s_shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+#   define s_shared_lock()      pthread_mutex_lock (&s_shared_mutex)
+#   define s_shared_unlock()    pthread_mutex_unlock (&s_shared_mutex)
+#else
+#   define s_shared_lock()
+#   define s_shared_unlock()
+#endif
+static zmosq_reactor_t *s_reactor = NULL;
+static size_t s_reactor_refs = 0;
+
+//  Signature of mosquitto_publish, so selftest can stand in for it
+typedef int (s_publish_fn) (
+    mosquitto_t *mosq, int *mid, const char *topic,
+    int payloadlen, const void *payload, int qos, bool retain);
+
+typedef struct _s_conn_t s_conn_t;
+
 //  Structure of our actor
 struct _zmosq_server_t {
     zsock_t *pipe;              //  Actor command pipe
     bool terminated;            //  Did caller ask us to quit?
     bool verbose;               //  Verbose logging enabled?
+    bool started;               //  Are connections started?
+    bool events;                //  Forward connection events to the pipe?
+    int64_t subscriptions_deadline; //  zclock_mono to flush changed topics by, 0 = none
+    int64_t start_deadline;     //  START with timeout: zclock_mono to give up, 0 = none
 
     zuuid_t *uuid;              //  uuid, used for generating unique (inproc) endpoint
-    zsock_t *mqtt_reader;
-    zsock_t *mqtt_writter;
+    zsock_t *data_writter;      //  DIRECT mode: socket feeding the consumer, or NULL
+    zsock_t *pub;               //  PUB mode: socket publishing to consumers, or NULL
+#if defined (HAVE_MALAMUTE)
+    mlm_client_t *mlm;          //  MLM mode: malamute client, or NULL
+#endif
+    bool mlm_producer;          //  MLM mode: messages go to malamute stream
+    zsock_t *ingress;           //  INGRESS: messages to publish to MQTT, or NULL
+#if defined (__UNIX__)
+    pthread_mutex_t data_mutex; //  DIRECT mode: serializes connections on data_writter
+#endif
+    zhashx_t *interned;         //  INTERN mode: topic ids by topic, or NULL
+    zhashx_t *cache;            //  CACHE: last values by topic, or NULL
+    zmosq_trie_t *routes;       //  ROUTE: s_route_t by MQTT pattern, or NULL
+    zhashx_t *route_sockets;    //  ROUTE: s_route_t by endpoint
+    zlistx_t *route_targets;    //  ROUTE: s_route_t matched by current message
+    size_t route_mark;          //  ROUTE: number of current message
+    size_t ring_size;           //  RING mode: size of ring of each connection, 0 = off
     zpoller_t *poller;          //  Socket poller
 
+    s_limit_t relay;            //  LIMIT of messages from network loop to actor
+    s_limit_t deliver;          //  LIMIT of messages from actor to pipe
+    zlistx_t *outbox;           //  Messages waiting for room in pipe
+    size_t outbox_bytes;        //  Bytes of content in outbox
+    zhashx_t *conflated;        //  CONFLATE: outbox handles by topic, or NULL
+    size_t superseded;          //  CONFLATE: messages replaced by newer ones
+
+                                //  STATS, all updated by the actor only:
+    size_t published;           //      messages passed to mosquitto_publish
+    size_t published_bytes;     //      bytes of their payloads
+    size_t publish_failed;      //      messages mosquitto_publish refused
+    size_t commands;            //      commands read, PUBLISH-MANY counts once
+    int64_t command_at;         //      zclock_usecs when timed command was read
+    s_histogram_t delivery;     //      network loop callback to sinks
+    s_histogram_t publishing;   //      command read to mosquitto_publish done
+
+                                //  batching of delivered messages:
+    size_t batch_max;           //      flush after this many messages, 0 = off
+    size_t batch_max_bytes;     //      flush after this many bytes
+    int64_t batch_max_usecs;    //      flush when first message is this old
+    zmsg_t *batch;              //      [topic|payload]... pending in batch
+    size_t batch_bytes;         //      bytes pending in batch
+    int64_t batch_started;      //      zclock_usecs of first message in batch
+
                                 //  mosquitto:
-    mosquitto_t *mosq;          //      client structure 
+    s_conn_t **conns;           //      connections, topics are partitioned by hash
+    size_t shards;              //      number of connections
+    size_t generation;          //      times connections were replaced
+    s_loop_t loop;              //      who drives network loop
+    zmosq_reactor_t *reactor;   //      LOOP_REACTOR: shared reactor
+    s_publish_fn *publish;      //      mosquitto_publish
     char *host;                 //      hostname or ip of the broker to connect to
     int port;                   //      port
     int keepalive;              //      keepalive in seconds
+    int reconnect_min;          //      reconnect backoff in msecs, doubles
+    int reconnect_max;          //      from min to max while attempts fail
+    size_t max_packet;          //      largest SUBSCRIBE packet to send
     char *bind_address;         //      hostname or ip of local network interface to bind to
     zlistx_t *topics;           //      MQQT topics to subscribe to
+
+    char *topic_buffer;         //  Reused for topics read from frames
+    size_t topic_buffer_size;   //  Allocated size of topic_buffer
+};
+
+//  One MQTT connection of the actor
+struct _s_conn_t {
+    zmosq_server_t *server;     //  Actor owning the connection
+    size_t index;               //  Position in server->conns
+    mosquitto_t *mosq;          //  mosquitto client structure
+    zsock_t *mqtt_reader;       //  Actor side of internal socket
+    zsock_t *mqtt_writter;      //  Network loop side of internal socket
+    zmosq_ring_t *ring;         //  RING mode: messages from network loop, or NULL
+    bool ring_pending;          //  Ring was left with messages after last drain
+    SOCKET socket;              //  LOOP_ACTOR: socket in poller or INVALID_SOCKET
+    int64_t misc_at;            //  LOOP_ACTOR: time of next mosquitto_loop_misc
+    int64_t reconnect_at;       //  LOOP_ACTOR: time of next reconnect, 0 = never
+    size_t reconnects;          //  LOOP_ACTOR: failed reconnects in a row
+    size_t queued;              //  LIMIT: messages on the way to actor
+    size_t queued_bytes;        //  LIMIT: bytes on the way to actor
+    size_t dropped;             //  LIMIT: messages dropped by network loop
+
+                                //  STATS, written by network loop only:
+    size_t received;            //      messages received
+    size_t received_bytes;      //      bytes of their payloads
+    size_t connects;            //      successful connects to the broker
+    size_t sent;                //      messages sent to actor
+    int64_t probe_at;           //      zclock_usecs of message being timed
+    size_t probe_seq;           //      its sequence number in sent, 0 = none
+    size_t arrived;             //  STATS: messages read by actor
+    bool connected;             //  Actor: is connection up?
+    zlistx_t *packets;          //  Actor: packets waiting for SUBACK or UNSUBACK
+    zlistx_t *unsubscribing;    //  Actor: names of topics to unsubscribe
 };
 
 
+static s_topic_t *
+s_topic_new (const char *name, int qos)
+{
+    s_topic_t *self = (s_topic_t *) zmalloc (sizeof (s_topic_t));
+    assert (self);
+    self->name = strdup (name);
+    assert (self->name);
+    self->qos = qos;
+    self->granted = -1;
+    return self;
+}
+
+static void
+s_topic_destroy (s_topic_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_topic_t *self = *self_p;
+        zstr_free (&self->name);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+static int
+s_topic_compare (const void *item1, const void *item2)
+{
+    return strcmp (((s_topic_t *) item1)->name, ((s_topic_t *) item2)->name);
+}
+
+static void
+s_packet_destroy (s_packet_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_packet_t *self = *self_p;
+        zlistx_destroy (&self->topics);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  Get the process-wide reactor, the first user decides how many threads
+//  it has. Return NULL if the platform has no reactor.
+
+static zmosq_reactor_t *
+s_reactor_acquire (size_t threads)
+{
+    s_shared_lock ();
+    if (!s_reactor)
+        s_reactor = zmosq_reactor_new (threads);
+    if (s_reactor)
+        s_reactor_refs++;
+    zmosq_reactor_t *reactor = s_reactor;
+    s_shared_unlock ();
+    return reactor;
+}
+
+//  Release the process-wide reactor, last user stops its threads
+
+static void
+s_reactor_release (zmosq_reactor_t **reactor_p)
+{
+    assert (reactor_p);
+    if (*reactor_p) {
+        s_shared_lock ();
+        assert (*reactor_p == s_reactor);
+        if (--s_reactor_refs == 0)
+            zmosq_reactor_destroy (&s_reactor);
+        s_shared_unlock ();
+        *reactor_p = NULL;
+    }
+}
+
+
+//  Is there a limit on the stage?
+
+static bool
+s_limited (s_limit_t *limit)
+{
+    return limit->max_count || limit->max_bytes;
+}
+
+
+//  Would the stage be over its limit with so many messages and bytes?
+
+static bool
+s_over (s_limit_t *limit, size_t count, size_t bytes)
+{
+    return (limit->max_count && count > limit->max_count)
+        || (limit->max_bytes && bytes > limit->max_bytes);
+}
+
+
+//  STATS: add to counter which has only one writer, readers in other threads
+//  see it with zmosq_atomic_load. No locked instruction is needed.
+
+static inline void
+s_count (size_t *counter, size_t value)
+{
+    zmosq_atomic_store (counter, *counter + value, ZMOSQ_RELAXED);
+}
+
+
+//  STATS: return bucket of histogram for value
+
+static size_t
+s_histogram_index (uint64_t value)
+{
+    if (value < 8)
+        return (size_t) value;
+    int magnitude = 63 - zmosq_clz64 (value);
+    size_t index = (size_t) (magnitude - 2) * 8 + (size_t) ((value >> (magnitude - 3)) & 7);
+    return index < S_HISTOGRAM_SIZE? index: S_HISTOGRAM_SIZE - 1;
+}
+
+
+//  STATS: return highest value which falls into bucket of histogram
+
+static uint64_t
+s_histogram_value (size_t index)
+{
+    if (index < 8)
+        return index;
+    int magnitude = (int) (index / 8) + 2;
+    return ((uint64_t) (8 + index % 8 + 1) << (magnitude - 3)) - 1;
+}
+
+
+static void
+s_histogram_record (s_histogram_t *histogram, int64_t value)
+{
+    if (value < 0)
+        value = 0;
+    histogram->counts [s_histogram_index ((uint64_t) value)]++;
+    histogram->count++;
+    if ((uint64_t) value > histogram->max)
+        histogram->max = (uint64_t) value;
+}
+
+
+//  STATS: return value below which percentile of recorded values fall
+
+static uint64_t
+s_histogram_percentile (s_histogram_t *histogram, double percentile)
+{
+    uint64_t wanted = (uint64_t) (histogram->count * percentile / 100.0 + 0.5);
+    if (wanted == 0)
+        wanted = 1;
+    uint64_t seen = 0;
+    size_t index;
+    for (index = 0; index < S_HISTOGRAM_SIZE; index++) {
+        seen += histogram->counts [index];
+        if (seen >= wanted) {
+            uint64_t value = s_histogram_value (index);
+            return value < histogram->max? value: histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+
+static void
+    s_connect (mosquitto_t *mosq, void *obj, int result);
+static void
+    s_disconnect (mosquitto_t *mosq, void *obj, int result);
+static void
+    s_subscribe (mosquitto_t *mosq, void *obj, int mid, int qos_count, const int *granted);
+static void
+    s_unsubscribe (mosquitto_t *mosq, void *obj, int mid);
+static void
+    s_message (mosquitto_t *mosq, void *obj, const struct mosquitto_message *message);
+
+//  Destroy the connection
+
+static void
+s_conn_destroy (s_conn_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        s_conn_t *self = *self_p;
+        if (self->mosq) {
+            mosquitto_destroy (self->mosq);
+            self->mosq = NULL;
+        }
+        zsock_destroy (&self->mqtt_writter);
+        zsock_destroy (&self->mqtt_reader);
+        zlistx_destroy (&self->packets);
+        zlistx_destroy (&self->unsubscribing);
+        if (self->ring) {
+            zmsg_t *msg;
+            while ((msg = (zmsg_t *) zmosq_ring_pop (self->ring)))
+                zmsg_destroy (&msg);
+            zmosq_ring_destroy (&self->ring);
+        }
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  Create connection number index of the actor, return NULL if it fails
+
+static s_conn_t *
+s_conn_new (zmosq_server_t *server, size_t index)
+{
+    s_conn_t *self = (s_conn_t *) zmalloc (sizeof (s_conn_t));
+    if (!self)
+        return NULL;
+    self->server = server;
+    self->index = index;
+    self->socket = INVALID_SOCKET;
+    self->packets = zlistx_new ();
+    self->unsubscribing = zlistx_new ();
+    if (!self->packets || !self->unsubscribing) {
+        s_conn_destroy (&self);
+        return NULL;
+    }
+    zlistx_set_destructor (self->packets, (czmq_destructor *) s_packet_destroy);
+    zlistx_set_duplicator (self->unsubscribing, (czmq_duplicator *) strdup);
+    zlistx_set_destructor (self->unsubscribing, (czmq_destructor *) zstr_free);
+    zlistx_set_comparator (self->unsubscribing, (czmq_comparator *) strcmp);
+
+    //  mqtt_reader, mqtt_writter
+    //  New connections are bound while the ones they replace still are
+    char *endpoint = zsys_sprintf (" inproc://%s-mqtt-%zu-%zu",
+        zuuid_str_canonical (server->uuid), server->generation, index);
+    if (!endpoint) {
+        s_conn_destroy (&self);
+        return NULL;
+    }
+    self->mqtt_writter = zsock_new (ZMQ_PAIR);
+    self->mqtt_reader  = zsock_new (ZMQ_PAIR);
+    if (!self->mqtt_writter || !self->mqtt_reader) {
+        zstr_free (&endpoint);
+        s_conn_destroy (&self);
+        return NULL;
+    }
+    //  Relay limit replaces HWM, which would block network loop too early.
+    //  Reactor thread is shared with other connections and must never block.
+    if (s_limited (&server->relay) || server->loop == LOOP_REACTOR) {
+        zsock_set_sndhwm (self->mqtt_writter, 0);
+        zsock_set_rcvhwm (self->mqtt_reader, 0);
+    }
+    endpoint [0] = '@';
+    int rc = zsock_attach (self->mqtt_writter, endpoint, true);
+    endpoint [0] = '>';
+    if (rc == 0)
+        rc = zsock_attach (self->mqtt_reader, endpoint, false);
+    zstr_free (&endpoint);
+    if (rc == -1) {
+        s_conn_destroy (&self);
+        return NULL;
+    }
+
+    if (server->ring_size) {
+        self->ring = zmosq_ring_new (server->ring_size);
+        if (!self->ring) {
+            s_conn_destroy (&self);
+            return NULL;
+        }
+    }
+
+    //  First connection keeps uuid as client id, others get index appended
+    char *id = index
+        ? zsys_sprintf ("%s-%zu", zuuid_str_canonical (server->uuid), index)
+        : strdup (zuuid_str_canonical (server->uuid));
+    if (id)
+        self->mosq = mosquitto_new (id, false, self);
+    zstr_free (&id);
+    if (!self->mosq) {
+        s_conn_destroy (&self);
+        return NULL;
+    }
+    mosquitto_connect_callback_set (self->mosq, s_connect);
+    mosquitto_disconnect_callback_set (self->mosq, s_disconnect);
+    mosquitto_subscribe_callback_set (self->mosq, s_subscribe);
+    mosquitto_unsubscribe_callback_set (self->mosq, s_unsubscribe);
+    mosquitto_message_callback_set (self->mosq, s_message);
+    return self;
+}
+
+
+//  Return index of connection owning topic, topics are partitioned among
+//  connections by FNV-1a hash
+
+static size_t
+s_shard (const char *topic, size_t shards)
+{
+    assert (topic);
+    uint32_t hash = 2166136261u;
+    while (*topic) {
+        hash ^= (byte) *topic++;
+        hash *= 16777619u;
+    }
+    return hash % shards;
+}
+
+
+//  Replace connections of the actor by given number of new ones. Return 0
+//  if OK, else -1 and actor keeps connections it had.
+
+static int
+s_conns_set (zmosq_server_t *self, size_t shards)
+{
+    assert (self);
+    assert (!self->started);
+    self->generation++;
+    s_conn_t **conns = (s_conn_t **) zmalloc (shards * sizeof (s_conn_t *));
+    if (!conns)
+        return -1;
+    size_t index;
+    for (index = 0; index < shards; index++) {
+        conns [index] = s_conn_new (self, index);
+        if (!conns [index]) {
+            while (index)
+                s_conn_destroy (&conns [--index]);
+            free (conns);
+            return -1;
+        }
+    }
+
+    for (index = 0; index < self->shards; index++) {
+        zpoller_remove (self->poller, self->conns [index]->mqtt_reader);
+        s_conn_destroy (&self->conns [index]);
+    }
+    free (self->conns);
+    self->conns = conns;
+    self->shards = shards;
+    for (index = 0; index < shards; index++)
+        zpoller_add (self->poller, self->conns [index]->mqtt_reader);
+    return 0;
+}
+
+
 //  --------------------------------------------------------------------------
 //  Create a new zmosq_server instance
 
@@ -63,6 +561,9 @@ zmosq_server_new (zsock_t *pipe, void *args)
     self->pipe = pipe;
     self->terminated = false;
     self->verbose = false;
+#if defined (__UNIX__)
+    pthread_mutex_init (&self->data_mutex, NULL);
+#endif
 
     //  uuid
     self->uuid = zuuid_new ();
@@ -71,43 +572,35 @@ zmosq_server_new (zsock_t *pipe, void *args)
         return NULL;
     }
 
-    //  mqtt_reader, mqtt_writter
-    char *endpoint = zsys_sprintf (" inproc://%s-mqtt", zuuid_str_canonical (self->uuid));
-    if (!endpoint) {
+    //  poller
+    self->poller = zpoller_new (self->pipe, NULL);
+    if (!self->poller) {
         zmosq_server_destroy (&self);
         return NULL;
     }
 
-    endpoint [0] = '@';
-    self->mqtt_writter = zsock_new_pair (endpoint);
-    endpoint [0] = '>';
-    self->mqtt_reader  = zsock_new_pair (endpoint);
-    zstr_free (&endpoint);
-    if (!self->mqtt_writter || !self->mqtt_reader) {
-        zmosq_server_destroy (&self);
-        return NULL;
-    }
-    
-    //  poller
-    self->poller = zpoller_new (self->pipe, self->mqtt_reader, NULL);
-    if (!self->poller) {
+    //  outbox
+    self->outbox = zlistx_new ();
+    if (!self->outbox) {
         zmosq_server_destroy (&self);
         return NULL;
     }
+    zlistx_set_destructor (self->outbox, (czmq_destructor *) zmsg_destroy);
 
-    //  mosq + related
-    self->mosq = mosquitto_new (
-        zuuid_str_canonical (self->uuid),
-        false,
-        self);
-    if (!self->mosq) {
+    //  conns, one unless SHARDS asks for more
+    if (s_conns_set (self, 1)) {
         zmosq_server_destroy (&self);
         return NULL;
     }
 
+    self->publish = mosquitto_publish;
+    self->loop = LOOP_THREAD;
     self->host = strdup ("");
     self->port = -1;
     self->keepalive = -1;
+    self->reconnect_min = 1000;
+    self->reconnect_max = 30000;
+    self->max_packet = 65536;
     self->bind_address = strdup ("");
     if (!self->host || !self->bind_address) {
         zmosq_server_destroy (&self);
@@ -119,9 +612,8 @@ zmosq_server_new (zsock_t *pipe, void *args)
         zmosq_server_destroy (&self);
         return NULL;
     }
-    zlistx_set_duplicator (self->topics, (czmq_duplicator *) strdup);
-    zlistx_set_destructor (self->topics, (czmq_destructor *) zstr_free);
-    zlistx_set_comparator (self->topics, (czmq_comparator *) strcmp);
+    zlistx_set_destructor (self->topics, (czmq_destructor *) s_topic_destroy);
+    zlistx_set_comparator (self->topics, s_topic_compare);
 
     return self;
 }
@@ -137,36 +629,144 @@ zmosq_server_destroy (zmosq_server_t **self_p)
     if (*self_p) {
         zmosq_server_t *self = *self_p;
 
+        size_t index;
+        for (index = 0; index < self->shards; index++)
+            s_conn_destroy (&self->conns [index]);
+        free (self->conns);
         zuuid_destroy (&self->uuid);
-        zsock_destroy (&self->mqtt_writter);
-        zsock_destroy (&self->mqtt_reader);
+        zsock_destroy (&self->data_writter);
+        zsock_destroy (&self->pub);
+#if defined (HAVE_MALAMUTE)
+        mlm_client_destroy (&self->mlm);
+#endif
+        zsock_destroy (&self->ingress);
+#if defined (__UNIX__)
+        pthread_mutex_destroy (&self->data_mutex);
+#endif
         zpoller_destroy (&self->poller);
-        if (self->mosq) {
-            mosquitto_destroy (self->mosq);
-            self->mosq = NULL;
-        }
+        zmsg_destroy (&self->batch);
+        zlistx_destroy (&self->outbox);
+        zhashx_destroy (&self->conflated);
+        zhashx_destroy (&self->interned);
+        zhashx_destroy (&self->cache);
+        zmosq_trie_destroy (&self->routes);
+        zhashx_destroy (&self->route_sockets);
+        zlistx_destroy (&self->route_targets);
+        s_reactor_release (&self->reactor);
         zstr_free (&self->host);
         zstr_free (&self->bind_address);
         zlistx_destroy (&self->topics);
+        zstr_free (&self->topic_buffer);
         free (self);
         *self_p = NULL;
     }
 }
 
+//  LOOP_ACTOR: start polling mosquitto socket, if there is one
+
 static void
-s_mosquitto_init ()
+s_loop_attach (s_conn_t *self)
 {
-    static bool initialized = false;
-    if (!initialized) {
-        int r = mosquitto_lib_init ();
-        if (r != MOSQ_ERR_SUCCESS) {
-            zsys_error ("Cannot initialize mosquitto library: %s", mosquitto_strerror (r));
-            exit (EXIT_FAILURE);
+    assert (self);
+    if (self->socket != INVALID_SOCKET)
+        return;
+    self->socket = mosquitto_socket (self->mosq);
+    if (self->socket == INVALID_SOCKET)
+        return;
+    zpoller_add (self->server->poller, &self->socket);
+    self->misc_at = zclock_mono () + 1000;
+    self->reconnect_at = 0;
+}
+
+
+//  LOOP_ACTOR: stop polling mosquitto socket
+
+static void
+s_loop_detach (s_conn_t *self)
+{
+    assert (self);
+    if (self->socket == INVALID_SOCKET)
+        return;
+    zpoller_remove (self->server->poller, &self->socket);
+    self->socket = INVALID_SOCKET;
+}
+
+
+//  LOOP_ACTOR: return msecs to wait before next reconnect, counted until
+//  connection comes up
+
+static int
+s_backoff (s_conn_t *self)
+{
+    zmosq_server_t *server = self->server;
+    return zmosq_reactor_backoff (
+        server->reconnect_min, server->reconnect_max, self->reconnects++);
+}
+
+
+//  LOOP_ACTOR: do the work of mosquitto network thread, readable tells if
+//  there is data on mosquitto socket. Lost connection is re-established
+//  after reconnect backoff.
+
+static void
+s_loop_service (s_conn_t *self, bool readable)
+{
+    assert (self);
+    int64_t now = zclock_mono ();
+    if (self->socket == INVALID_SOCKET) {
+        if (self->reconnect_at && now >= self->reconnect_at) {
+            if (mosquitto_reconnect_async (self->mosq) == MOSQ_ERR_SUCCESS)
+                s_loop_attach (self);
+            else
+                self->reconnect_at = now + s_backoff (self);
         }
-        initialized = true;
+        return;
+    }
+
+    int r = MOSQ_ERR_SUCCESS;
+    if (readable)
+        r = mosquitto_loop_read (self->mosq, 1);
+    if (r == MOSQ_ERR_SUCCESS && mosquitto_want_write (self->mosq))
+        r = mosquitto_loop_write (self->mosq, 1);
+    if (r == MOSQ_ERR_SUCCESS && now >= self->misc_at) {
+        r = mosquitto_loop_misc (self->mosq);
+        self->misc_at = now + 1000;
+    }
+    if (r != MOSQ_ERR_SUCCESS) {
+        if (self->server->verbose)
+            zsys_debug ("Connection %zu to %s:%d lost: %s",
+                self->index, self->server->host, self->server->port, mosquitto_strerror (r));
+        s_loop_detach (self);
+        self->reconnect_at = now + s_backoff (self);
     }
 }
 
+
+//  LOOP_ACTOR: return how long the actor may wait before network loop needs
+//  servicing, in msecs, -1 if there is nothing to wait for
+
+static int
+s_loop_timeout (s_conn_t *self)
+{
+    assert (self);
+    int64_t at;
+    if (self->socket != INVALID_SOCKET) {
+        //  Unsent data, we can't poll for output so retry soon
+        if (mosquitto_want_write (self->mosq))
+            return 10;
+        at = self->misc_at;
+    }
+    else
+    if (self->reconnect_at)
+        at = self->reconnect_at;
+    else
+        return -1;
+
+    int64_t remaining = at - zclock_mono ();
+    return remaining > 0? (int) remaining: 0;
+}
+
+
 //  Start this actor. Return a value greater or equal to zero if initialization
 //  was successful. Otherwise -1.
 
@@ -174,26 +774,58 @@ static int
 zmosq_server_start (zmosq_server_t *self)
 {
     assert (self);
-    assert (self->mosq);
 
-    mosquitto_loop_start (self->mosq);
-    int r;
-    r = mosquitto_connect_bind_async (
-        self->mosq,
-        self->host,
-        self->port,
-        self->keepalive,
-        self->bind_address);
+    //  Reactor thread must not wait for a slow DIRECT consumer
+    if (self->data_writter)
+        zsock_set_sndtimeo (self->data_writter, self->loop == LOOP_REACTOR? 0: -1);
+
+    size_t index;
+    for (index = 0; index < self->shards; index++) {
+        s_conn_t *conn = self->conns [index];
+        if (self->loop == LOOP_THREAD) {
+            //  Library counts reconnect delay in whole seconds and has no
+            //  jitter, so jitter is applied once to the initial delay
+            int delay = zmosq_reactor_backoff (self->reconnect_min, self->reconnect_max, 0);
+            mosquitto_reconnect_delay_set (conn->mosq,
+                (unsigned int) (delay + 999) / 1000,
+                (unsigned int) (self->reconnect_max + 999) / 1000,
+                self->reconnect_max > self->reconnect_min);
+            mosquitto_loop_start (conn->mosq);
+        }
+        //  Reactor thread and actor both use the client
+        if (self->loop == LOOP_REACTOR)
+            mosquitto_threaded_set (conn->mosq, true);
+        int r;
+        r = mosquitto_connect_bind_async (
+            conn->mosq,
+            self->host,
+            self->port,
+            self->keepalive,
+            self->bind_address);
 
-    if (r != MOSQ_ERR_SUCCESS) {
-        zsys_error ("Can't connect to mosquito endpoint, run START again");
-        mosquitto_loop_stop (self->mosq, true);
+        if (r != MOSQ_ERR_SUCCESS) {
+            zsys_error ("Can't connect to mosquito endpoint, run START again");
+            if (self->loop == LOOP_THREAD)
+                mosquitto_loop_stop (conn->mosq, true);
+        }
+        else
+        if (self->loop == LOOP_ACTOR)
+            s_loop_attach (conn);
+        else
+        if (self->loop == LOOP_REACTOR
+        &&  zmosq_reactor_add (self->reactor, conn->mosq,
+                self->reconnect_min, self->reconnect_max) == -1)
+            zsys_error ("Can't add connection to reactor, run START again");
     }
+    self->started = true;
 
     return 0;
 }
 
 
+static void
+    s_relay (zmosq_server_t *self, s_conn_t *conn);
+
 //  Stop this actor. Return a value greater or equal to zero if stopping 
 //  was successful. Otherwise -1.
 
@@ -201,39 +833,1744 @@ static int
 zmosq_server_stop (zmosq_server_t *self)
 {
     assert (self);
-    assert (self->mosq);
 
     //  TODO: Add shutdown actions
-    mosquitto_loop_stop (self->mosq, true);
-    mosquitto_disconnect (self->mosq);
+    size_t index;
+    for (index = 0; index < self->shards; index++) {
+        s_conn_t *conn = self->conns [index];
+        if (self->loop == LOOP_THREAD)
+            mosquitto_loop_stop (conn->mosq, true);
+        else
+        if (self->loop == LOOP_REACTOR) {
+            //  Take client from reactor thread before touching it. Reactor
+            //  does not block on us, still drain what it has sent meanwhile.
+            while (zmosq_reactor_remove (self->reactor, conn->mosq, 10) == -1) {
+                if (zsock_events (conn->mqtt_reader) & ZMQ_POLLIN)
+                    s_relay (self, conn);
+            }
+            mosquitto_threaded_set (conn->mosq, false);
+        }
+        mosquitto_disconnect (conn->mosq);
+        conn->connected = false;
+        zlistx_purge (conn->packets);
+        if (self->loop == LOOP_ACTOR) {
+            s_loop_detach (conn);
+            conn->reconnect_at = 0;
+        }
+    }
+    self->started = false;
 
     return 0;
 }
 
-//  Here we handle incoming message from the node
-static void
-zmosq_server_recv_api (zmosq_server_t *self)
+//  Can the message be dropped from outbox? Topic announcements can't, the
+//  consumer would not know what the id stands for.
+
+static bool
+s_droppable (zmosq_server_t *self, zmsg_t *msg)
 {
-    //  Get the whole message of the pipe in one go
-    zmsg_t *request = zmsg_recv (self->pipe);
-    if (!request)
-       return;        //  Interrupted
+    return !self->interned || !zframe_streq (zmsg_first (msg), "$TOPIC");
+}
 
-    char *command = zmsg_popstr (request);
-    if (streq (command, "START"))
-        zmosq_server_start (self);
-    else
-    if (streq (command, "STOP")) {
-        zmosq_server_stop (self);
-    }
-    else
-    if (streq (command, "VERBOSE"))
-        self->verbose = true;
-    else
-    if (streq (command, "CONNECT")) {
-        zstr_free (&self->host);
-        self->host = zmsg_popstr (request);
-        assert (self->host);
+
+//  CONFLATE: outbox messages are keyed by their first frame, which is the
+//  topic or its id
+
+static size_t
+s_frame_hash (const void *key)
+{
+    zframe_t *frame = (zframe_t *) key;
+    byte *data = zframe_data (frame);
+    size_t size = zframe_size (frame);
+    size_t hash = 2166136261u;
+    while (size--) {
+        hash ^= *data++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int
+s_frame_compare (const void *key1, const void *key2)
+{
+    return zframe_eq ((zframe_t *) key1, (zframe_t *) key2)? 0: 1;
+}
+
+static void *
+s_frame_dup (const void *key)
+{
+    return zframe_dup ((zframe_t *) key);
+}
+
+static void
+s_frame_free (void **key_p)
+{
+    zframe_destroy ((zframe_t **) key_p);
+}
+
+
+//  Take message under cursor out of outbox
+
+static zmsg_t *
+s_outbox_detach (zmosq_server_t *self)
+{
+    void *handle = zlistx_cursor (self->outbox);
+    zmsg_t *msg = (zmsg_t *) zlistx_item (self->outbox);
+    if (self->conflated
+    &&  zhashx_lookup (self->conflated, zmsg_first (msg)) == handle)
+        zhashx_delete (self->conflated, zmsg_first (msg));
+    zlistx_detach_cur (self->outbox);
+    self->outbox_bytes -= zmsg_content_size (msg);
+    return msg;
+}
+
+
+//  Send messages from outbox while the pipe has room. If wait is true, the
+//  oldest message is sent even if that means waiting for the consumer.
+
+static void
+s_outbox_flush (zmosq_server_t *self, bool wait)
+{
+    while (zlistx_size (self->outbox)
+    &&    (wait || (zsock_events (self->pipe) & ZMQ_POLLOUT))) {
+        zlistx_first (self->outbox);
+        zmsg_t *msg = s_outbox_detach (self);
+        zmsg_send (&msg, self->pipe);
+        wait = false;
+    }
+}
+
+
+//  Drop oldest or newest message from outbox, as deliver policy says.
+//  Return false if there is no message which can be dropped.
+
+static bool
+s_outbox_drop (zmosq_server_t *self)
+{
+    bool newest = self->deliver.policy == POLICY_DROP_NEWEST;
+    zmsg_t *msg = (zmsg_t *) (newest? zlistx_last (self->outbox): zlistx_first (self->outbox));
+    while (msg && !s_droppable (self, msg))
+        msg = (zmsg_t *) (newest? zlistx_prev (self->outbox): zlistx_next (self->outbox));
+    if (!msg)
+        return false;
+
+    msg = s_outbox_detach (self);
+    zmsg_destroy (&msg);
+    self->deliver.dropped++;
+    return true;
+}
+
+
+//  Send message to the consumer on the pipe. With deliver limit, message
+//  waits in outbox until the pipe has room and the limit policy is applied
+//  once outbox is full. With CONFLATE, message waiting in outbox is replaced
+//  by newer one on the same topic.
+
+static void
+s_send (zmosq_server_t *self, zmsg_t **msg_p)
+{
+    assert (self);
+    assert (msg_p);
+    if (zlistx_size (self->outbox) == 0
+    &&  ((!s_limited (&self->deliver) && !self->conflated)
+    ||   (zsock_events (self->pipe) & ZMQ_POLLOUT))) {
+        zmsg_send (msg_p, self->pipe);
+        return;
+    }
+
+    zmsg_t *msg = *msg_p;
+    *msg_p = NULL;
+    //  Batches and announcements are never conflated
+    if (self->conflated && zmsg_size (msg) <= 2 && s_droppable (self, msg)) {
+        void *handle = zhashx_lookup (self->conflated, zmsg_first (msg));
+        if (handle) {
+            zmsg_t *older = (zmsg_t *) zlistx_handle_item (handle);
+            self->outbox_bytes -= zmsg_content_size (older);
+            zlistx_delete (self->outbox, handle);
+            self->superseded++;
+        }
+        handle = zlistx_add_end (self->outbox, msg);
+        zhashx_update (self->conflated, zmsg_first (msg), handle);
+    }
+    else
+        zlistx_add_end (self->outbox, msg);
+    self->outbox_bytes += zmsg_content_size (msg);
+    while (s_over (&self->deliver, zlistx_size (self->outbox), self->outbox_bytes)) {
+        if (self->deliver.policy == POLICY_BLOCK)
+            s_outbox_flush (self, true);
+        else
+        if (!s_outbox_drop (self))
+            break;
+    }
+    s_outbox_flush (self, false);
+}
+
+
+//  Network loop side of relay limit: account message on the way to actor.
+//  Return 0 if message may be queued, -1 if it's dropped. Blocked network
+//  loop does not answer broker's pings, so it waits for half of keepalive
+//  at most and drops the message then, rather than lose the session.
+
+static int
+s_relay_admit (zmosq_server_t *self, s_conn_t *conn, zmsg_t *msg)
+{
+    s_limit_t *limit = &self->relay;
+    if (!s_limited (limit))
+        return 0;
+
+    size_t size = zmsg_content_size (msg);
+    int64_t deadline = 0;
+    while (s_over (limit,
+        zmosq_atomic_load (&conn->queued, ZMOSQ_RELAXED) + 1,
+        zmosq_atomic_load (&conn->queued_bytes, ZMOSQ_RELAXED) + size)) {
+        if (limit->policy == POLICY_DROP_NEWEST) {
+            zmosq_atomic_fetch_add (&conn->dropped, 1);
+            return -1;
+        }
+        if (limit->policy == POLICY_DROP_OLDEST)
+            break;              //  Actor drops the oldest when it reads them
+        if (!deadline)
+            deadline = zclock_mono ()
+                     + (self->keepalive > 0? self->keepalive: 60) * 500;
+        else
+        if (zclock_mono () >= deadline) {
+            zmosq_atomic_fetch_add (&conn->dropped, 1);
+            return -1;
+        }
+        zclock_sleep (1);
+    }
+    zmosq_atomic_fetch_add (&conn->queued, 1);
+    zmosq_atomic_fetch_add (&conn->queued_bytes, size);
+    return 0;
+}
+
+
+//  Network loop side of relay limit: message admitted by s_relay_admit was
+//  dropped before it got to the actor after all
+
+static void
+s_relay_undo (zmosq_server_t *self, s_conn_t *conn, zmsg_t *msg)
+{
+    zmosq_atomic_fetch_add (&conn->dropped, 1);
+    if (!s_limited (&self->relay))
+        return;
+    zmosq_atomic_fetch_sub (&conn->queued, 1);
+    zmosq_atomic_fetch_sub (&conn->queued_bytes, zmsg_content_size (msg));
+}
+
+
+//  Actor side of relay limit: account message read from connection. Return
+//  true if it's to be dropped, as it is the oldest one over the limit.
+
+static bool
+s_relay_done (zmosq_server_t *self, s_conn_t *conn, zmsg_t *msg)
+{
+    s_limit_t *limit = &self->relay;
+    if (!s_limited (limit) || !msg)
+        return false;
+
+    size_t size = zmsg_content_size (msg);
+    size_t queued = zmosq_atomic_fetch_sub (&conn->queued, 1);
+    size_t queued_bytes = zmosq_atomic_fetch_sub (&conn->queued_bytes, size);
+    if (limit->policy == POLICY_DROP_OLDEST && s_over (limit, queued, queued_bytes)) {
+        limit->dropped++;
+        return true;
+    }
+    return false;
+}
+
+
+//  Return number of messages dropped by relay limit
+
+static size_t
+s_relay_dropped (zmosq_server_t *self)
+{
+    size_t dropped = self->relay.dropped;
+    size_t index;
+    for (index = 0; index < self->shards; index++)
+        dropped += zmosq_atomic_load (&self->conns [index]->dropped, ZMOSQ_RELAXED);
+    return dropped;
+}
+
+
+//  Send the pending batch to the pipe as one message
+
+#if defined (HAVE_MALAMUTE)
+static void
+    s_mlm_flush (zmosq_server_t *self);
+#endif
+
+static void
+s_batch_flush (zmosq_server_t *self)
+{
+    assert (self);
+    if (self->batch && zmsg_size (self->batch) > 0) {
+#if defined (HAVE_MALAMUTE)
+        if (self->mlm_producer)
+            s_mlm_flush (self);
+        else
+#endif
+            s_send (self, &self->batch);
+    }
+    zmsg_destroy (&self->batch);
+    self->batch_bytes = 0;
+}
+
+
+//  Return how long the poller may sleep before the pending batch is due,
+//  in msecs, -1 if there is nothing to wait for
+
+static int
+s_batch_timeout (zmosq_server_t *self)
+{
+    assert (self);
+    if (!self->batch)
+        return -1;
+    int64_t remaining = self->batch_started + self->batch_max_usecs - zclock_usecs ();
+    if (remaining <= 0)
+        return 0;
+    return (int) ((remaining + 999) / 1000);
+}
+
+
+//  Return topic as a string, the buffer is owned by the actor and is valid
+//  until next call
+
+static const char *
+s_topic_str (zmosq_server_t *self, const byte *data, size_t size)
+{
+    assert (self);
+    if (size + 1 > self->topic_buffer_size) {
+        char *buffer = (char *) realloc (self->topic_buffer, size + 1);
+        assert (buffer);
+        self->topic_buffer = buffer;
+        self->topic_buffer_size = size + 1;
+    }
+    memcpy (self->topic_buffer, data, size);
+    self->topic_buffer [size] = 0;
+    return self->topic_buffer;
+}
+
+
+//  Return content of frame as a string, see s_topic_str
+
+static const char *
+s_frame_topic (zmosq_server_t *self, zframe_t *frame)
+{
+    assert (frame);
+    return s_topic_str (self, zframe_data (frame), zframe_size (frame));
+}
+
+
+#if defined (HAVE_MALAMUTE)
+//  MLM mode: send batch [topic|payload|...] to malamute stream, one stream
+//  message per topic, with payloads of the topic as frames in the order
+//  they came. Order across topics is not kept.
+
+static void
+s_mlm_flush (zmosq_server_t *self)
+{
+    zhashx_t *subjects = zhashx_new ();
+    zlistx_t *messages = zlistx_new ();
+    assert (subjects && messages);
+
+    zframe_t *topic = zmsg_pop (self->batch);
+    while (topic) {
+        zframe_t *payload = zmsg_pop (self->batch);
+        const char *subject = s_frame_topic (self, topic);
+        zmsg_t *msg = (zmsg_t *) zhashx_lookup (subjects, subject);
+        if (msg)
+            zframe_destroy (&topic);
+        else {
+            msg = zmsg_new ();
+            assert (msg);
+            zhashx_insert (subjects, subject, msg);
+            zlistx_add_end (messages, msg);
+            zmsg_append (msg, &topic);
+        }
+        zmsg_append (msg, &payload);
+        topic = zmsg_pop (self->batch);
+    }
+    zmsg_t *msg = (zmsg_t *) zlistx_first (messages);
+    while (msg) {
+        topic = zmsg_pop (msg);
+        size_t payloads = zmsg_size (msg);
+        if (mlm_client_send (self->mlm, s_frame_topic (self, topic), &msg) == -1)
+            self->deliver.dropped += payloads;
+        zmsg_destroy (&msg);
+        zframe_destroy (&topic);
+        msg = (zmsg_t *) zlistx_next (messages);
+    }
+    zlistx_destroy (&messages);
+    zhashx_destroy (&subjects);
+}
+#endif
+
+
+//  INTERN mode: return id of topic. New topic gets the next id, and the
+//  mapping is announced to sink as ["$TOPIC"|id|topic] before first use.
+//  Return S_INTERN_FAILED if sink can't take the announcement now, topic
+//  is announced again with its next message.
+
+#define S_INTERN_FAILED UINT32_MAX
+
+static uint32_t
+s_intern (zmosq_server_t *self, const char *topic, zsock_t *sink)
+{
+    assert (self);
+    assert (self->interned);
+    void *item = zhashx_lookup (self->interned, topic);
+    if (item)
+        return (uint32_t) ((uintptr_t) item - 1);
+
+    uint32_t id = (uint32_t) zhashx_size (self->interned);
+    zhashx_insert (self->interned, topic, (void *) (uintptr_t) (id + 1));
+    byte id_data [4] = {
+        (byte) (id >> 24), (byte) (id >> 16), (byte) (id >> 8), (byte) id
+    };
+    zmsg_t *announce = zmsg_new ();
+    zmsg_addstr (announce, "$TOPIC");
+    zmsg_addmem (announce, id_data, sizeof (id_data));
+    zmsg_addstr (announce, topic);
+    if (sink == self->pipe)
+        s_send (self, &announce);
+    else
+    if (zmsg_send (&announce, sink) == -1) {
+        zmsg_destroy (&announce);
+        zhashx_delete (self->interned, topic);
+        return S_INTERN_FAILED;
+    }
+    return id;
+}
+
+
+//  INTERN mode: put 4 bytes id of topic, network byte order, in front of
+//  message. Return 0 if OK, -1 if topic could not be announced.
+
+static int
+s_intern_push (zmosq_server_t *self, zmsg_t *msg, const char *topic, zsock_t *sink)
+{
+    uint32_t id = s_intern (self, topic, sink);
+    if (id == S_INTERN_FAILED)
+        return -1;
+    byte id_data [4] = {
+        (byte) (id >> 24), (byte) (id >> 16), (byte) (id >> 8), (byte) id
+    };
+    zmsg_pushmem (msg, id_data, sizeof (id_data));
+    return 0;
+}
+
+
+//  ROUTE: socket of an endpoint
+
+typedef struct {
+    zsock_t *socket;            //  PUSH socket
+    size_t mark;                //  route_mark of last message it took
+} s_route_t;
+
+static void
+s_route_socket_free (void **item_p)
+{
+    s_route_t *route = (s_route_t *) *item_p;
+    if (route) {
+        zsock_destroy (&route->socket);
+        free (route);
+        *item_p = NULL;
+    }
+}
+
+
+//  ROUTE: add route of messages matching MQTT pattern to socket connected
+//  or bound to endpoint. Return 0 if OK, else -1.
+
+static int
+s_route_add (zmosq_server_t *self, const char *pattern, const char *endpoint)
+{
+    assert (self);
+    if (!self->routes) {
+        self->routes = zmosq_trie_new ();
+        self->route_sockets = zhashx_new ();
+        self->route_targets = zlistx_new ();
+        if (!self->routes || !self->route_sockets || !self->route_targets)
+            return -1;
+        zhashx_set_destructor (self->route_sockets, s_route_socket_free);
+    }
+    s_route_t *route = (s_route_t *) zhashx_lookup (self->route_sockets, endpoint);
+    if (!route) {
+        route = (s_route_t *) zmalloc (sizeof (s_route_t));
+        if (!route)
+            return -1;
+        route->socket = zsock_new_push (endpoint);
+        if (!route->socket) {
+            free (route);
+            return -1;
+        }
+        //  Never block the actor on a slow route
+        zsock_set_sndtimeo (route->socket, 0);
+        zhashx_insert (self->route_sockets, endpoint, route);
+    }
+    return zmosq_trie_insert (self->routes, pattern, route);
+}
+
+
+//  ROUTE: collect socket of matching route, each socket once, however many
+//  of its patterns match the message
+
+static void
+s_route_collect (void *item, void *arg)
+{
+    zmosq_server_t *self = (zmosq_server_t *) arg;
+    s_route_t *route = (s_route_t *) item;
+    if (route->mark != self->route_mark) {
+        route->mark = self->route_mark;
+        zlistx_add_end (self->route_targets, route);
+    }
+}
+
+
+//  ROUTE: send copy of message to every socket its topic matches, message
+//  is dropped by routes which can't take it now. Return number of sockets.
+
+static size_t
+s_route_send (zmosq_server_t *self, zmsg_t *msg)
+{
+    //  Marks start at 0 in new routes, so first message is 1
+    self->route_mark++;
+    if (!zmosq_trie_match (self->routes, s_frame_topic (self, zmsg_first (msg)),
+            s_route_collect, self))
+        return 0;
+
+    size_t count = zlistx_size (self->route_targets);
+    s_route_t *route = (s_route_t *) zlistx_first (self->route_targets);
+    while (route) {
+        zmsg_t *copy = zmsg_dup (msg);
+        if (copy && zmsg_send (&copy, route->socket) == -1)
+            zmsg_destroy (&copy);
+        route = (s_route_t *) zlistx_next (self->route_targets);
+    }
+    zlistx_purge (self->route_targets);
+    return count;
+}
+
+
+//  CACHE: last value received on a topic
+
+typedef struct {
+    int64_t received;           //  Time of receive, msecs since the epoch
+    zframe_t *payload;          //  Last payload
+} s_value_t;
+
+static void
+s_value_free (void **item_p)
+{
+    s_value_t *value = (s_value_t *) *item_p;
+    if (value) {
+        zframe_destroy (&value->payload);
+        free (value);
+        *item_p = NULL;
+    }
+}
+
+
+//  CACHE: remember payload of message [topic|payload] as last value of its
+//  topic. Payload of cached topic is copied in place of the older one.
+
+static void
+s_cache_update (zmosq_server_t *self, zmsg_t *msg)
+{
+    assert (self);
+    assert (self->cache);
+    zframe_t *topic = zmsg_first (msg);
+    zframe_t *payload = zmsg_next (msg);
+    const char *key = s_frame_topic (self, topic);
+    s_value_t *value = (s_value_t *) zhashx_lookup (self->cache, key);
+    if (!value) {
+        value = (s_value_t *) zmalloc (sizeof (s_value_t));
+        assert (value);
+        value->payload = zframe_new_empty ();
+        assert (value->payload);
+        zhashx_insert (self->cache, key, value);
+    }
+    if (payload)
+        zframe_reset (value->payload, zframe_data (payload), zframe_size (payload));
+    else
+        zframe_reset (value->payload, NULL, 0);
+    value->received = zclock_time ();
+}
+
+
+//  CACHE: append [topic|received|payload] of cached value to message
+
+static void
+s_cache_append (zmsg_t *msg, const char *topic, s_value_t *value)
+{
+    zmsg_addstr (msg, topic);
+    zmsg_addstrf (msg, "%" PRId64, value->received);
+    zframe_t *payload = zframe_dup (value->payload);
+    zmsg_append (msg, &payload);
+}
+
+
+//  CACHE: reply to GET with ["$VALUE"|topic|received|payload], or with
+//  ["$VALUE"|topic] if topic has no value cached
+
+static void
+s_cache_get (zmosq_server_t *self, const char *topic)
+{
+    zmsg_t *reply = zmsg_new ();
+    zmsg_addstr (reply, "$VALUE");
+    s_value_t *value = self->cache? (s_value_t *) zhashx_lookup (self->cache, topic): NULL;
+    if (value)
+        s_cache_append (reply, topic, value);
+    else
+        zmsg_addstr (reply, topic);
+    zmsg_send (&reply, self->pipe);
+}
+
+
+//  CACHE: reply to SNAPSHOT with ["$SNAPSHOT"|topic|received|payload|...]
+//  for all cached topics matching MQTT pattern
+
+static void
+s_cache_snapshot (zmosq_server_t *self, const char *pattern)
+{
+    zmsg_t *reply = zmsg_new ();
+    zmsg_addstr (reply, "$SNAPSHOT");
+    s_value_t *value = self->cache? (s_value_t *) zhashx_first (self->cache): NULL;
+    while (value) {
+        const char *topic = (const char *) zhashx_cursor (self->cache);
+        bool matches = false;
+        if (mosquitto_topic_matches_sub (pattern, topic, &matches) == MOSQ_ERR_SUCCESS
+        &&  matches)
+            s_cache_append (reply, topic, value);
+        value = (s_value_t *) zhashx_next (self->cache);
+    }
+    zmsg_send (&reply, self->pipe);
+}
+
+
+//  Deliver a MQTT message [topic|payload] read from mosquitto thread to the
+//  consumer, either directly or as a part of the current batch
+
+static void
+s_deliver (zmosq_server_t *self, zmsg_t **msg_p)
+{
+    assert (self);
+    assert (msg_p);
+    zmsg_t *msg = *msg_p;
+    if (!msg)
+        return;
+
+    if (self->cache)
+        s_cache_update (self, msg);
+
+    //  Messages taken by a route do not go to the consumer
+    if (self->routes && s_route_send (self, msg)) {
+        zmsg_destroy (msg_p);
+        return;
+    }
+
+    //  Subscribers filter on topic, so it's sent as is and never batched
+    if (self->pub) {
+        zmsg_send (msg_p, self->pub);
+        return;
+    }
+
+#if defined (HAVE_MALAMUTE)
+    //  MQTT topic becomes subject of the stream message, batches go to the
+    //  stream in s_batch_flush
+    if (self->mlm_producer && self->batch_max == 0) {
+        zframe_t *topic = zmsg_pop (msg);
+        if (mlm_client_send (self->mlm, s_frame_topic (self, topic), msg_p) == -1)
+            self->deliver.dropped++;
+        zmsg_destroy (msg_p);
+        zframe_destroy (&topic);
+        return;
+    }
+#endif
+
+    if (self->interned && !self->mlm_producer) {
+        zframe_t *topic = zmsg_pop (msg);
+        s_intern_push (self, msg, s_frame_topic (self, topic), self->pipe);
+        zframe_destroy (&topic);
+    }
+
+    if (self->batch_max == 0) {
+        s_send (self, msg_p);
+        return;
+    }
+
+    if (!self->batch) {
+        self->batch = zmsg_new ();
+        self->batch_started = zclock_usecs ();
+    }
+    self->batch_bytes += zmsg_content_size (msg);
+
+    //  Keep batch made of pairs even for messages without payload
+    zframe_t *topic = zmsg_pop (msg);
+    zframe_t *payload = zmsg_pop (msg);
+    if (!payload)
+        payload = zframe_new_empty ();
+    zmsg_append (self->batch, &topic);
+    zmsg_append (self->batch, &payload);
+    zmsg_destroy (msg_p);
+
+    if (zmsg_size (self->batch) / 2 >= self->batch_max
+    ||  self->batch_bytes >= self->batch_max_bytes)
+        s_batch_flush (self);
+}
+
+
+//  Is this the wake-up mosquitto thread sends in RING mode?
+
+static bool
+s_is_wakeup (zmsg_t *msg)
+{
+    return zmsg_size (msg) == 1 && zframe_size (zmsg_first (msg)) == 0;
+}
+
+
+//  Send one SUBSCRIBE packet for count topics at given QoS, or UNSUBSCRIBE
+//  packet, and remember it until broker acknowledges it. Return 1 if sent,
+//  else 0.
+
+static size_t
+s_packet_send (s_conn_t *conn, char **topics, int count, int qos, bool unsubscribe)
+{
+    if (count == 0)
+        return 0;
+    int mid, r;
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1006000
+    if (unsubscribe)
+        r = mosquitto_unsubscribe_multiple (conn->mosq, &mid, count, topics, NULL);
+    else
+        r = mosquitto_subscribe_multiple (conn->mosq, &mid, count, topics, qos, 0, NULL);
+#else
+    assert (count == 1);
+    if (unsubscribe)
+        r = mosquitto_unsubscribe (conn->mosq, &mid, topics [0]);
+    else
+        r = mosquitto_subscribe (conn->mosq, &mid, topics [0], qos);
+#endif
+    if (r != MOSQ_ERR_SUCCESS) {
+        zsys_warning ("Can't %s %d topics starting with %s: %s",
+            unsubscribe? "unsubscribe": "subscribe to",
+            count, topics [0], mosquitto_strerror (r));
+        return 0;
+    }
+    s_packet_t *packet = (s_packet_t *) zmalloc (sizeof (s_packet_t));
+    assert (packet);
+    packet->mid = mid;
+    packet->topics = zlistx_new ();
+    assert (packet->topics);
+    zlistx_set_duplicator (packet->topics, (czmq_duplicator *) strdup);
+    zlistx_set_destructor (packet->topics, (czmq_destructor *) zstr_free);
+    int index;
+    for (index = 0; index < count; index++)
+        zlistx_add_end (packet->topics, topics [index]);
+    zlistx_add_end (conn->packets, packet);
+    return 1;
+}
+
+
+//  Send count topics in as few packets as fit in max_packet bytes, return
+//  number of packets sent
+
+static size_t
+s_packets_send (zmosq_server_t *self, s_conn_t *conn, char **topics, int count, int qos, bool unsubscribe)
+{
+    size_t packets = 0;
+    int first = 0;
+    //  Fixed header with longest remaining length and packet id
+    size_t packet_size = 5 + 2;
+    int index;
+    for (index = 0; index < count; index++) {
+        //  Topic length, topic and requested QoS
+        size_t size = 2 + strlen (topics [index]) + 1;
+        if (index > first
+        && (!S_SUBSCRIBE_MULTIPLE || packet_size + size > self->max_packet)) {
+            packets += s_packet_send (conn, topics + first, index - first, qos, unsubscribe);
+            first = index;
+            packet_size = 5 + 2;
+        }
+        packet_size += size;
+    }
+    packets += s_packet_send (conn, topics + first, count - first, qos, unsubscribe);
+    return packets;
+}
+
+
+//  Subscribe connection to its share of topics, or only to those changed
+//  since last time. Topics asking for the same QoS share packets. Return
+//  number of packets sent.
+
+static size_t
+s_conn_subscribe (zmosq_server_t *self, s_conn_t *conn, bool pending_only)
+{
+    char **names = (char **) zmalloc ((zlistx_size (self->topics) + 1) * sizeof (char *));
+    assert (names);
+    size_t packets = 0;
+    int qos;
+    for (qos = 0; qos <= 2; qos++) {
+        int count = 0;
+        s_topic_t *topic = (s_topic_t *) zlistx_first (self->topics);
+        while (topic) {
+            if (topic->qos == qos
+            &&  (topic->pending || !pending_only)
+            &&  s_shard (topic->name, self->shards) == conn->index) {
+                names [count++] = topic->name;
+                topic->granted = -1;
+                topic->sent = true;
+                topic->pending = false;
+            }
+            topic = (s_topic_t *) zlistx_next (self->topics);
+        }
+        packets += s_packets_send (self, conn, names, count, qos, false);
+    }
+    free (names);
+    return packets;
+}
+
+
+//  Unsubscribe connection from topics removed since last time, return
+//  number of packets sent
+
+static size_t
+s_conn_unsubscribe (zmosq_server_t *self, s_conn_t *conn)
+{
+    size_t count = zlistx_size (conn->unsubscribing);
+    if (count == 0)
+        return 0;
+    char **names = (char **) zmalloc (count * sizeof (char *));
+    assert (names);
+    size_t index = 0;
+    char *name = (char *) zlistx_first (conn->unsubscribing);
+    while (name) {
+        names [index++] = name;
+        name = (char *) zlistx_next (conn->unsubscribing);
+    }
+    size_t packets = s_packets_send (self, conn, names, (int) count, 0, true);
+    free (names);
+    zlistx_purge (conn->unsubscribing);
+    return packets;
+}
+
+
+//  Apply SUBSCRIBE and UNSUBSCRIBE commands received since last time to
+//  live sessions, all changes of a connection go out in shared packets.
+//  Connections which are down get everything when they come up.
+
+static void
+s_subscriptions_flush (zmosq_server_t *self)
+{
+    size_t index;
+    for (index = 0; index < self->shards; index++) {
+        s_conn_t *conn = self->conns [index];
+        if (conn->connected) {
+            s_conn_unsubscribe (self, conn);
+            s_conn_subscribe (self, conn, true);
+        }
+    }
+    s_topic_t *topic = (s_topic_t *) zlistx_first (self->topics);
+    while (topic) {
+        topic->pending = false;
+        topic = (s_topic_t *) zlistx_next (self->topics);
+    }
+    self->subscriptions_deadline = 0;
+}
+
+
+//  Topics changed, flush them to live sessions once the burst of commands
+//  is over, but not later than S_SUBSCRIPTIONS_DELAY
+
+static void
+s_subscriptions_changed (zmosq_server_t *self)
+{
+    if (!self->subscriptions_deadline)
+        self->subscriptions_deadline = zclock_mono () + S_SUBSCRIPTIONS_DELAY;
+}
+
+
+//  Find topic the actor subscribes to by name, or NULL
+
+static s_topic_t *
+s_topic_lookup (zmosq_server_t *self, const char *name)
+{
+    s_topic_t probe;
+    memset (&probe, 0, sizeof (probe));
+    probe.name = (char *) name;
+    void *handle = zlistx_find (self->topics, &probe);
+    return handle? (s_topic_t *) zlistx_handle_item (handle): NULL;
+}
+
+
+//  Subscribe on topic with QoS, or change QoS of known topic. Change goes
+//  to live sessions with the next flush.
+
+static void
+s_topic_subscribe (zmosq_server_t *self, const char *name, int qos)
+{
+    s_topic_t *topic = s_topic_lookup (self, name);
+    if (!topic) {
+        topic = s_topic_new (name, qos);
+        zlistx_add_end (self->topics, topic);
+        topic->pending = true;
+    }
+    else
+    if (topic->qos != qos) {
+        topic->qos = qos;
+        topic->pending = true;
+    }
+    //  Subscribed again before unsubscribe went out
+    s_conn_t *conn = self->conns [s_shard (name, self->shards)];
+    void *handle = zlistx_find (conn->unsubscribing, (void *) name);
+    if (handle) {
+        zlistx_delete (conn->unsubscribing, handle);
+        topic->pending = true;
+    }
+    if (topic->pending)
+        s_subscriptions_changed (self);
+}
+
+
+//  Match SUBACK [$SUBACK|shard|mid|granted...] with its SUBSCRIBE packet,
+//  note granted QoS of the topics and put their names in the event, so it
+//  becomes [$SUBACK|shard|mid|topic|granted|topic|granted...]. UNSUBACK
+//  [$UNSUBACK|shard|mid] becomes [$UNSUBACK|shard|mid|topic|topic...].
+
+static void
+s_suback (zmosq_server_t *self, s_conn_t *conn, zmsg_t *event)
+{
+    zframe_t *header [3];
+    int index;
+    for (index = 0; index < 3; index++)
+        header [index] = zmsg_pop (event);
+    char *mid = zframe_strdup (header [2]);
+    s_packet_t *packet = (s_packet_t *) zlistx_first (conn->packets);
+    while (packet && packet->mid != atoi (mid))
+        packet = (s_packet_t *) zlistx_next (conn->packets);
+    zstr_free (&mid);
+
+    if (packet && zmsg_size (event) == 0) {
+        char *name = (char *) zlistx_first (packet->topics);
+        while (name) {
+            zmsg_addstr (event, name);
+            name = (char *) zlistx_next (packet->topics);
+        }
+        zlistx_delete (conn->packets, zlistx_cursor (conn->packets));
+    }
+    else
+    if (packet) {
+        size_t count = zmsg_size (event);
+        char *name = (char *) zlistx_first (packet->topics);
+        while (count-- && name) {
+            char *granted = zmsg_popstr (event);
+            s_topic_t *topic = s_topic_lookup (self, name);
+            if (topic)
+                topic->granted = atoi (granted);
+            if (atoi (granted) == 0x80)
+                zsys_warning ("Broker refused subscription to %s", name);
+            zmsg_addstr (event, name);
+            zmsg_addstr (event, granted);
+            zstr_free (&granted);
+            name = (char *) zlistx_next (packet->topics);
+        }
+        zlistx_delete (conn->packets, zlistx_cursor (conn->packets));
+    }
+    for (index = 2; index >= 0; index--)
+        zmsg_prepend (event, &header [index]);
+}
+
+
+//  Reply ["$SUBSCRIPTIONS"|topic|qos|granted|...] with QoS asked for and
+//  granted by broker for every topic, granted is -1 until SUBACK comes
+
+static void
+s_subscriptions (zmosq_server_t *self)
+{
+    zmsg_t *reply = zmsg_new ();
+    zmsg_addstr (reply, "$SUBSCRIPTIONS");
+    s_topic_t *topic = (s_topic_t *) zlistx_first (self->topics);
+    while (topic) {
+        zmsg_addstr (reply, topic->name);
+        zmsg_addstrf (reply, "%d", topic->qos);
+        zmsg_addstrf (reply, "%d", topic->granted);
+        topic = (s_topic_t *) zlistx_next (self->topics);
+    }
+    zmsg_send (&reply, self->pipe);
+}
+
+
+//  START with timeout: reply ["$STARTED"|"OK"] once every connection is up
+//  and its subscriptions are acknowledged, or ["$STARTED"|"TIMEOUT"] when
+//  the time is up
+
+static void
+s_start_check (zmosq_server_t *self)
+{
+    if (!self->start_deadline)
+        return;
+    bool ready = true;
+    size_t index;
+    for (index = 0; index < self->shards && ready; index++)
+        ready = self->conns [index]->connected
+            &&  zlistx_size (self->conns [index]->packets) == 0;
+    if (ready || zclock_mono () >= self->start_deadline) {
+        zstr_sendx (self->pipe, "$STARTED", ready? "OK": "TIMEOUT", NULL);
+        self->start_deadline = 0;
+    }
+}
+
+
+//  Is this an event of network loop, [""|event|...]?
+
+static bool
+s_is_event (zmsg_t *msg)
+{
+    return zmsg_size (msg) > 1 && zframe_size (zmsg_first (msg)) == 0;
+}
+
+
+//  Handle connection event [event|shard|...] from network loop. Connection
+//  which comes up subscribes its topics here, so topics are only touched by
+//  the actor.
+
+static void
+s_event_handle (zmosq_server_t *self, s_conn_t *conn, zmsg_t **event_p)
+{
+    zmsg_t *event = *event_p;
+    zframe_t *name = zmsg_first (event);
+    if (zframe_streq (name, "$CONNECTED")) {
+        conn->connected = true;
+        conn->reconnects = 0;
+        zlistx_purge (conn->packets);
+        //  Session may remember topics removed while we were away
+        size_t packets = s_conn_unsubscribe (self, conn);
+        packets += s_conn_subscribe (self, conn, false);
+        zmsg_addstrf (event, "%zu", packets);
+    }
+    else
+    if (zframe_streq (name, "$SUBACK") || zframe_streq (name, "$UNSUBACK"))
+        s_suback (self, conn, event);
+    else
+    if (zframe_streq (name, "$DISCONNECTED")) {
+        conn->connected = false;
+        zlistx_purge (conn->packets);
+    }
+    if (self->verbose) {
+        char *text = zframe_strdup (zmsg_first (event));
+        zsys_debug ("connection %zu: %s", conn->index, text);
+        zstr_free (&text);
+    }
+    if (self->events)
+        zmsg_send (event_p, self->pipe);
+    else
+        zmsg_destroy (event_p);
+    s_start_check (self);
+}
+
+
+//  STATS: account message read from connection by actor and delivered.
+//  Network loop times one message at a time, and the actor records the
+//  latency once that message gets here.
+
+static void
+s_arrived (zmosq_server_t *self, s_conn_t *conn)
+{
+    conn->arrived++;
+    size_t seq = zmosq_atomic_load (&conn->probe_seq, ZMOSQ_ACQUIRE);
+    if (seq && conn->arrived >= seq) {
+        s_histogram_record (&self->delivery, zclock_usecs () - conn->probe_at);
+        zmosq_atomic_store (&conn->probe_seq, 0, ZMOSQ_RELEASE);
+    }
+}
+
+
+//  Deliver messages queued in the ring of connection. To keep the pipe
+//  responsive at most one ring full of messages is taken, if more are left
+//  the actor comes back without waiting for next wake-up.
+
+static void
+s_ring_drain (zmosq_server_t *self, s_conn_t *conn)
+{
+    assert (self);
+    assert (conn->ring);
+    size_t limit = zmosq_ring_capacity (conn->ring);
+    while (limit--) {
+        zmsg_t *msg = (zmsg_t *) zmosq_ring_pop (conn->ring);
+        if (msg) {
+            if (s_relay_done (self, conn, msg))
+                zmsg_destroy (&msg);
+            s_deliver (self, &msg);
+            s_arrived (self, conn);
+        }
+        else
+        if (zmosq_ring_sleep (conn->ring)) {
+            conn->ring_pending = false;
+            return;
+        }
+    }
+    conn->ring_pending = true;
+}
+
+
+//  Read everything network loop of connection queued on the internal socket
+
+static void
+s_relay (zmosq_server_t *self, s_conn_t *conn)
+{
+    assert (self);
+    assert (conn);
+    //  When batching, take everything already queued in one go
+    size_t limit = self->batch_max? self->batch_max: 1;
+    do {
+        zmsg_t *msg = zmsg_recv (conn->mqtt_reader);
+        if (msg && s_is_wakeup (msg)) {
+            zmsg_destroy (&msg);
+            s_ring_drain (self, conn);
+        }
+        else
+        if (msg && s_is_event (msg)) {
+            //  Messages received before the event may still be in the ring
+            if (conn->ring)
+                s_ring_drain (self, conn);
+            zframe_t *empty = zmsg_pop (msg);
+            zframe_destroy (&empty);
+            s_event_handle (self, conn, &msg);
+        }
+        else
+        if (msg) {
+            if (s_relay_done (self, conn, msg))
+                zmsg_destroy (&msg);
+            s_deliver (self, &msg);
+            s_arrived (self, conn);
+        }
+    } while (--limit
+         && (zsock_events (conn->mqtt_reader) & ZMQ_POLLIN));
+}
+
+
+//  Return how long the actor may wait for the next event, in msecs
+
+static int
+s_poller_timeout (zmosq_server_t *self)
+{
+    int timeout = s_batch_timeout (self);
+    //  We can't poll for room in the pipe, so retry soon
+    if (zlistx_size (self->outbox) && (timeout == -1 || timeout > 1))
+        timeout = 1;
+    if (self->start_deadline) {
+        int start_timeout = (int) (self->start_deadline - zclock_mono ());
+        if (start_timeout < 0)
+            start_timeout = 0;
+        if (timeout == -1 || start_timeout < timeout)
+            timeout = start_timeout;
+    }
+    if (self->subscriptions_deadline) {
+        int flush_timeout = (int) (self->subscriptions_deadline - zclock_mono ());
+        if (flush_timeout < 0)
+            flush_timeout = 0;
+        if (timeout == -1 || flush_timeout < timeout)
+            timeout = flush_timeout;
+    }
+    size_t index;
+    for (index = 0; index < self->shards; index++) {
+        s_conn_t *conn = self->conns [index];
+        if (conn->ring_pending)
+            return 0;
+        if (self->loop == LOOP_ACTOR) {
+            int loop_timeout = s_loop_timeout (conn);
+            if (timeout == -1 || (loop_timeout != -1 && loop_timeout < timeout))
+                timeout = loop_timeout;
+        }
+    }
+    return timeout;
+}
+
+
+//  STATS: time one command in S_PROBE_INTERVAL, from here to its first
+//  mosquitto_publish
+
+static void
+s_command_probe (zmosq_server_t *self)
+{
+    self->command_at = ++self->commands % S_PROBE_INTERVAL == 1? zclock_usecs (): 0;
+}
+
+
+//  Publish payload on MQTT topic, return value of mosquitto_publish
+
+static int
+s_publish (zmosq_server_t *self, const char *topic, int qos, bool retain, const void *payload, size_t size)
+{
+    assert (self);
+    assert (topic);
+
+    //  Topic always goes out through the same connection, to keep its order
+    int r = self->publish (
+        self->conns [s_shard (topic, self->shards)]->mosq,
+        NULL,
+        topic,
+        (int) size,
+        payload,
+        qos,
+        retain);
+    if (r == MOSQ_ERR_SUCCESS) {
+        self->published++;
+        self->published_bytes += size;
+    }
+    else {
+        self->publish_failed++;
+        zsys_warning ("Message on topic %s not published: %s", topic, mosquitto_strerror (r));
+    }
+    //  Only first message of a timed command is recorded
+    if (self->command_at) {
+        s_histogram_record (&self->publishing, zclock_usecs () - self->command_at);
+        self->command_at = 0;
+    }
+    return r;
+}
+
+
+//  Parse qos frame (0-2), anything else is qos 0
+
+static int
+s_frame_qos (zframe_t *frame)
+{
+    if (!frame || zframe_size (frame) == 0)
+        return 0;
+    switch (zframe_data (frame) [0]) {
+        case '1' : return 1;
+        case '2' : return 2;
+    }
+    return 0;
+}
+
+
+//  Publish all [topic|qos|retain|payload] records from the message, one
+//  mosquitto_publish per record, return number of published records
+
+static size_t
+s_publish_many (zmosq_server_t *self, zmsg_t *request)
+{
+    assert (self);
+    assert (request);
+
+    size_t published = 0;
+    zframe_t *topic = zmsg_first (request);
+    while (topic) {
+        zframe_t *qos = zmsg_next (request);
+        zframe_t *retain = zmsg_next (request);
+        zframe_t *payload = zmsg_next (request);
+        if (!payload) {
+            zsys_error ("incomplete [topic|qos|retain|payload] record, ignoring the rest");
+            break;
+        }
+        int r = s_publish (
+            self,
+            s_frame_topic (self, topic),
+            s_frame_qos (qos),
+            zframe_streq (retain, "true"),
+            zframe_data (payload),
+            zframe_size (payload));
+        if (r == MOSQ_ERR_SUCCESS)
+            published++;
+        topic = zmsg_next (request);
+    }
+    return published;
+}
+
+
+//  Publish messages queued on ingress socket. At most S_INGRESS_BATCH
+//  messages are taken at once, so the pipe does not starve.
+
+#define S_INGRESS_BATCH 256
+
+static void
+s_ingress_drain (zmosq_server_t *self)
+{
+    assert (self);
+    size_t limit = S_INGRESS_BATCH;
+    do {
+        zmsg_t *msg = zmsg_recv (self->ingress);
+        if (!msg)
+            break;
+        s_command_probe (self);
+        s_publish_many (self, msg);
+        zmsg_destroy (&msg);
+    } while (--limit
+         && (zsock_events (self->ingress) & ZMQ_POLLIN));
+}
+
+
+//  STATS: append [name|value] to reply
+
+static void
+s_stats_add (zmsg_t *reply, const char *name, uint64_t value)
+{
+    zmsg_addstr (reply, name);
+    zmsg_addstrf (reply, "%" PRIu64, value);
+}
+
+
+//  STATS: append percentiles of histogram to reply, names get prefix
+
+static void
+s_stats_histogram (zmsg_t *reply, const char *prefix, s_histogram_t *histogram)
+{
+    char name [32];
+    snprintf (name, sizeof (name), "%s_count", prefix);
+    s_stats_add (reply, name, histogram->count);
+    snprintf (name, sizeof (name), "%s_p50", prefix);
+    s_stats_add (reply, name, s_histogram_percentile (histogram, 50));
+    snprintf (name, sizeof (name), "%s_p99", prefix);
+    s_stats_add (reply, name, s_histogram_percentile (histogram, 99));
+    snprintf (name, sizeof (name), "%s_p999", prefix);
+    s_stats_add (reply, name, s_histogram_percentile (histogram, 99.9));
+    snprintf (name, sizeof (name), "%s_max", prefix);
+    s_stats_add (reply, name, histogram->max);
+}
+
+
+//  STATS: reply with ["$STATS"|name|value|...], see zmosq_server.h
+
+static void
+s_stats (zmosq_server_t *self)
+{
+    size_t received = 0, received_bytes = 0, reconnects = 0, relay_queued = 0;
+    size_t index;
+    for (index = 0; index < self->shards; index++) {
+        s_conn_t *conn = self->conns [index];
+        received += zmosq_atomic_load (&conn->received, ZMOSQ_RELAXED);
+        received_bytes += zmosq_atomic_load (&conn->received_bytes, ZMOSQ_RELAXED);
+        size_t connects = zmosq_atomic_load (&conn->connects, ZMOSQ_RELAXED);
+        if (connects > 1)
+            reconnects += connects - 1;
+        relay_queued += zmosq_atomic_load (&conn->sent, ZMOSQ_RELAXED) - conn->arrived;
+    }
+    zmsg_t *reply = zmsg_new ();
+    zmsg_addstr (reply, "$STATS");
+    s_stats_add (reply, "received", received);
+    s_stats_add (reply, "received_bytes", received_bytes);
+    s_stats_add (reply, "reconnects", reconnects);
+    s_stats_add (reply, "relay_queued", relay_queued);
+    s_stats_add (reply, "relay_dropped", s_relay_dropped (self));
+    s_stats_add (reply, "deliver_queued", zlistx_size (self->outbox));
+    s_stats_add (reply, "deliver_queued_bytes", self->outbox_bytes);
+    s_stats_add (reply, "deliver_dropped", self->deliver.dropped);
+    s_stats_add (reply, "superseded", self->superseded);
+    s_stats_add (reply, "published", self->published);
+    s_stats_add (reply, "published_bytes", self->published_bytes);
+    s_stats_add (reply, "publish_failed", self->publish_failed);
+    s_stats_histogram (reply, "delivery_usecs", &self->delivery);
+    s_stats_histogram (reply, "publish_usecs", &self->publishing);
+    zmsg_send (&reply, self->pipe);
+}
+
+
+//  Binary commands, see zmosq_server.h for the encoding. Handler gets
+//  validated header and the body frame, returns -1 if they are malformed.
+//  Commands which fail otherwise are logged and counted by the handler.
+
+typedef int (s_binary_fn) (zmosq_server_t *self, const byte *header, zframe_t *body);
+
+static int
+s_binary_publish (zmosq_server_t *self, const byte *header, zframe_t *body)
+{
+    size_t topic_size = ((size_t) header [4] << 24) | ((size_t) header [5] << 16)
+                      | ((size_t) header [6] << 8)  |  (size_t) header [7];
+    int qos = header [2] & ZMOSQ_SERVER_FLAG_QOS;
+    if (topic_size == 0 || topic_size > zframe_size (body) || qos > 2)
+        return -1;
+
+    const byte *data = zframe_data (body);
+    s_publish (
+        self,
+        s_topic_str (self, data, topic_size),
+        qos,
+        (header [2] & ZMOSQ_SERVER_FLAG_RETAIN) != 0,
+        data + topic_size,
+        zframe_size (body) - topic_size);
+    return 0;
+}
+
+static s_binary_fn *s_binary_commands [] = {
+    NULL,                       //  0 is not a valid opcode
+    s_binary_publish,           //  ZMOSQ_SERVER_OP_PUBLISH
+};
+#define S_BINARY_COMMANDS (sizeof (s_binary_commands) / sizeof (s_binary_commands [0]))
+
+
+//  Is this the header frame of a binary command?
+
+static bool
+s_is_binary (zframe_t *frame)
+{
+    return frame
+        && zframe_size (frame) == ZMOSQ_SERVER_HEADER_SIZE
+        && zframe_data (frame) [0] == 0;
+}
+
+
+//  Execute all [header|body] pairs of binary request
+
+static void
+s_binary_dispatch (zmosq_server_t *self, zmsg_t *request)
+{
+    zframe_t *header = zmsg_first (request);
+    while (header) {
+        zframe_t *body = zmsg_next (request);
+        byte opcode = zframe_data (header) [1];
+        if (!body || !s_is_binary (header)
+        ||  opcode >= S_BINARY_COMMANDS || !s_binary_commands [opcode]
+        ||  s_binary_commands [opcode] (self, zframe_data (header), body) == -1) {
+            zsys_error ("invalid binary command, ignoring the rest");
+            break;
+        }
+        header = zmsg_next (request);
+    }
+}
+
+
+//  Here we handle incoming message from the node
+static void
+zmosq_server_recv_api (zmosq_server_t *self)
+{
+    //  Get the whole message of the pipe in one go
+    zmsg_t *request = zmsg_recv (self->pipe);
+    if (!request)
+       return;        //  Interrupted
+    s_command_probe (self);
+
+    if (s_is_binary (zmsg_first (request))) {
+        s_binary_dispatch (self, request);
+        zmsg_destroy (&request);
+        return;
+    }
+
+    char *command = zmsg_popstr (request);
+    if (streq (command, "START")) {
+        char *timeout = zmsg_popstr (request);
+        zmosq_server_start (self);
+        if (timeout) {
+            self->start_deadline = zclock_mono () + atoi (timeout);
+            s_start_check (self);
+        }
+        zstr_free (&timeout);
+    }
+    else
+    if (streq (command, "EVENTS"))
+        self->events = true;
+    else
+    if (streq (command, "STOP")) {
+        zmosq_server_stop (self);
+    }
+    else
+    if (streq (command, "VERBOSE"))
+        self->verbose = true;
+    else
+    if (streq (command, "BATCH")) {
+        char *count = zmsg_popstr (request);
+        char *bytes = zmsg_popstr (request);
+        char *usecs = zmsg_popstr (request);
+        s_batch_flush (self);
+        self->batch_max = count? strtoul (count, NULL, 10): 0;
+        self->batch_max_bytes = bytes? strtoul (bytes, NULL, 10): SIZE_MAX;
+        if (self->batch_max_bytes == 0)
+            self->batch_max_bytes = SIZE_MAX;
+        self->batch_max_usecs = usecs? strtoll (usecs, NULL, 10): 1000;
+        zstr_free (&count);
+        zstr_free (&bytes);
+        zstr_free (&usecs);
+    }
+    else
+    if (streq (command, "LOOP")) {
+        char *loop = zmsg_popstr (request);
+        char *threads = zmsg_popstr (request);
+        s_loop_t previous = self->loop;
+        //  Connections are torn down by the loop they were started with
+        if (self->started)
+            zsys_error ("LOOP: must be set before START");
+        else
+        if (loop && streq (loop, "actor"))
+            self->loop = LOOP_ACTOR;
+        else
+        if (loop && streq (loop, "thread"))
+            self->loop = LOOP_THREAD;
+        else
+        if (loop && streq (loop, "reactor")) {
+            if (s_limited (&self->relay) && self->relay.policy == POLICY_BLOCK)
+                zsys_error ("LOOP: reactor can't block on relay limit, use drop policy");
+            else {
+                if (!self->reactor)
+                    self->reactor = s_reactor_acquire (threads? strtoul (threads, NULL, 10): 4);
+                if (self->reactor)
+                    self->loop = LOOP_REACTOR;
+                else
+                    zsys_warning ("LOOP: reactor is not available, using mosquitto thread");
+            }
+        }
+        else
+            zsys_error ("LOOP: unknown network loop '%s'", loop? loop: "");
+
+        //  Reactor needs internal sockets without HWM, other loops get the
+        //  reactor back and HWM restored
+        if ((previous == LOOP_REACTOR) != (self->loop == LOOP_REACTOR)) {
+            if (s_conns_set (self, self->shards)) {
+                zsys_error ("LOOP: can't create connections, keeping previous loop");
+                self->loop = previous;
+            }
+            if (self->loop != LOOP_REACTOR)
+                s_reactor_release (&self->reactor);
+        }
+        zstr_free (&threads);
+        zstr_free (&loop);
+    }
+    else
+    if (streq (command, "RING")) {
+        char *size = zmsg_popstr (request);
+        if (self->started)
+            zsys_error ("RING: must be set before START");
+        else
+        if (!self->ring_size) {
+            self->ring_size = size? strtoul (size, NULL, 10): 65536;
+            if (s_conns_set (self, self->shards)) {
+                zsys_error ("RING: can't create connections with ring of %zu", self->ring_size);
+                self->ring_size = 0;
+            }
+        }
+        zstr_free (&size);
+    }
+    else
+    if (streq (command, "INTERN")) {
+        if (self->started)
+            zsys_error ("INTERN: must be set before START");
+        else
+        if (!self->interned) {
+            self->interned = zhashx_new ();
+            assert (self->interned);
+        }
+    }
+    else
+    if (streq (command, "ROUTE")) {
+        char *pattern = zmsg_popstr (request);
+        char *endpoint = zmsg_popstr (request);
+        if (!pattern || !endpoint
+        ||  s_route_add (self, pattern, endpoint) == -1)
+            zsys_error ("ROUTE: can't route '%s' to '%s'",
+                pattern? pattern: "", endpoint? endpoint: "");
+        else
+        if (self->verbose)
+            zsys_debug ("ROUTE: '%s' to '%s'", pattern, endpoint);
+        zstr_free (&pattern);
+        zstr_free (&endpoint);
+    }
+    else
+    if (streq (command, "LIMIT")) {
+        char *stage = zmsg_popstr (request);
+        char *count = zmsg_popstr (request);
+        char *bytes = zmsg_popstr (request);
+        char *policy = zmsg_popstr (request);
+        s_limit_t limit = {
+            count? strtoul (count, NULL, 10): 0,
+            bytes? strtoul (bytes, NULL, 10): 0,
+            POLICY_BLOCK,
+            0
+        };
+        bool valid = true;
+        if (policy && streq (policy, "drop-oldest"))
+            limit.policy = POLICY_DROP_OLDEST;
+        else
+        if (policy && streq (policy, "drop-newest"))
+            limit.policy = POLICY_DROP_NEWEST;
+        else
+        if (policy && !streq (policy, "block"))
+            valid = false;
+
+        if (valid && stage && streq (stage, "deliver")) {
+            limit.dropped = self->deliver.dropped;
+            self->deliver = limit;
+        }
+        else
+        if (valid && stage && streq (stage, "relay") && !self->started
+        &&  !(self->loop == LOOP_REACTOR && limit.policy == POLICY_BLOCK && s_limited (&limit))) {
+            s_limit_t previous = self->relay;
+            limit.dropped = self->relay.dropped;
+            self->relay = limit;
+            if (s_conns_set (self, self->shards)) {
+                zsys_error ("LIMIT: can't create connections, keeping previous relay limit");
+                self->relay = previous;
+            }
+        }
+        else
+            zsys_error ("LIMIT: invalid limit of '%s', relay must be set before START"
+                " and can't block with LOOP reactor", stage? stage: "");
+        zstr_free (&stage);
+        zstr_free (&count);
+        zstr_free (&bytes);
+        zstr_free (&policy);
+    }
+    else
+    if (streq (command, "DROPPED")) {
+        char *relay = zsys_sprintf ("%zu", s_relay_dropped (self));
+        char *deliver = zsys_sprintf ("%zu", self->deliver.dropped);
+        char *superseded = zsys_sprintf ("%zu", self->superseded);
+        zstr_sendx (self->pipe, "$DROPPED", relay, deliver, superseded, NULL);
+        zstr_free (&relay);
+        zstr_free (&deliver);
+        zstr_free (&superseded);
+    }
+    else
+    if (streq (command, "STATS"))
+        s_stats (self);
+    else
+    if (streq (command, "CACHE")) {
+        if (!self->cache) {
+            self->cache = zhashx_new ();
+            assert (self->cache);
+            zhashx_set_destructor (self->cache, s_value_free);
+        }
+    }
+    else
+    if (streq (command, "GET")) {
+        char *topic = zmsg_popstr (request);
+        s_cache_get (self, topic? topic: "");
+        zstr_free (&topic);
+    }
+    else
+    if (streq (command, "SNAPSHOT")) {
+        char *pattern = zmsg_popstr (request);
+        s_cache_snapshot (self, pattern? pattern: "#");
+        zstr_free (&pattern);
+    }
+    else
+    if (streq (command, "CONFLATE")) {
+        if (!self->conflated) {
+            self->conflated = zhashx_new ();
+            assert (self->conflated);
+            zhashx_set_key_hasher (self->conflated, s_frame_hash);
+            zhashx_set_key_comparator (self->conflated, s_frame_compare);
+            zhashx_set_key_duplicator (self->conflated, s_frame_dup);
+            zhashx_set_key_destructor (self->conflated, s_frame_free);
+        }
+    }
+    else
+    if (streq (command, "SHARDS")) {
+        char *shards = zmsg_popstr (request);
+        size_t count = shards? strtoul (shards, NULL, 10): 0;
+        if (self->started)
+            zsys_error ("SHARDS: must be set before START");
+        else
+        if (count == 0)
+            zsys_error ("SHARDS: invalid number of connections '%s'", shards? shards: "");
+        else
+        if (s_conns_set (self, count))
+            zsys_error ("SHARDS: can't create %zu connections, keeping %zu", count, self->shards);
+        zstr_free (&shards);
+    }
+    else
+    if (streq (command, "DIRECT")) {
+        //  Network loops read data_writter without a lock
+        if (self->started) {
+            zsys_error ("DIRECT: must be set before START");
+            zstr_send (self->pipe, "");
+        }
+        else {
+            if (!self->data_writter) {
+                char *endpoint = zsys_sprintf ("@inproc://%s-data", zuuid_str_canonical (self->uuid));
+                assert (endpoint);
+                self->data_writter = zsock_new_pair (endpoint);
+                assert (self->data_writter);
+                zstr_free (&endpoint);
+            }
+            zstr_send (self->pipe, zsock_endpoint (self->data_writter));
+        }
+    }
+    else
+    if (streq (command, "PUB")) {
+        char *endpoint = zmsg_popstr (request);
+        if (!self->pub) {
+            self->pub = zsock_new (ZMQ_PUB);
+            assert (self->pub);
+        }
+        char *bound = NULL;
+        if (endpoint && zsock_bind (self->pub, "%s", endpoint) != -1)
+            bound = zsock_last_endpoint (self->pub);
+        else
+            zsys_error ("PUB: can't bind to '%s'", endpoint? endpoint: "");
+        zstr_send (self->pipe, bound? bound: "");
+        zstr_free (&bound);
+        zstr_free (&endpoint);
+    }
+    else
+    if (streq (command, "INGRESS")) {
+        char *endpoint = zmsg_popstr (request);
+        char *type = zmsg_popstr (request);
+        if (!self->ingress) {
+            if (type && streq (type, "sub")) {
+                self->ingress = zsock_new (ZMQ_SUB);
+                if (self->ingress)
+                    zsock_set_subscribe (self->ingress, "");
+            }
+            else
+                self->ingress = zsock_new (ZMQ_PULL);
+            assert (self->ingress);
+            zpoller_add (self->poller, self->ingress);
+        }
+        char *bound = NULL;
+        if (endpoint && zsock_bind (self->ingress, "%s", endpoint) != -1)
+            bound = zsock_last_endpoint (self->ingress);
+        else
+            zsys_error ("INGRESS: can't bind to '%s'", endpoint? endpoint: "");
+        zstr_send (self->pipe, bound? bound: "");
+        zstr_free (&bound);
+        zstr_free (&type);
+        zstr_free (&endpoint);
+    }
+    else
+#if defined (HAVE_MALAMUTE)
+    if (streq (command, "MLM-CONNECT")) {
+        char *endpoint = zmsg_popstr (request);
+        char *timeout = zmsg_popstr (request);
+        char *address = zsys_sprintf ("zmosq-%s", zuuid_str_canonical (self->uuid));
+        assert (address);
+        mlm_client_destroy (&self->mlm);
+        self->mlm_producer = false;
+        self->mlm = mlm_client_new ();
+        assert (self->mlm);
+        //  Actor does nothing else while it waits for the broker
+        if (!endpoint
+        ||  mlm_client_connect (self->mlm, endpoint,
+                timeout? (uint32_t) strtoul (timeout, NULL, 10): 1000, address) == -1) {
+            zsys_error ("MLM-CONNECT: can't connect to malamute broker '%s'", endpoint? endpoint: "");
+            mlm_client_destroy (&self->mlm);
+        }
+        zstr_free (&address);
+        zstr_free (&timeout);
+        zstr_free (&endpoint);
+    }
+    else
+    if (streq (command, "MLM-PUBLISH")) {
+        char *stream = zmsg_popstr (request);
+        if (!self->mlm)
+            zsys_error ("MLM-PUBLISH: MLM-CONNECT first");
+        else
+        if (!stream || mlm_client_set_producer (self->mlm, stream) == -1)
+            zsys_error ("MLM-PUBLISH: can't publish to stream '%s'", stream? stream: "");
+        else
+            self->mlm_producer = true;
+        zstr_free (&stream);
+    }
+#else
+    if (streq (command, "MLM-CONNECT")
+    ||  streq (command, "MLM-PUBLISH"))
+        zsys_error ("%s: zmosq was built without malamute", command);
+#endif
+    else
+    if (streq (command, "CONNECT")) {
+        zstr_free (&self->host);
+        self->host = zmsg_popstr (request);
+        assert (self->host);
 
         char *foo = zmsg_popstr (request);
         self->port = atoi (foo);
@@ -251,47 +2588,98 @@ zmosq_server_recv_api (zmosq_server_t *self)
             self->bind_address = strdup (self->host);
     }
     else
-    if (streq (command, "SUBSCRIBE")) {
-        char *topic = zmsg_popstr (request);
-        while (topic) {
-            void *handle = zlistx_find (self->topics, (void *) topic);
-            if (!handle)
-                zlistx_add_end (self->topics, topic);
-            zstr_free (&topic);
-            topic = zmsg_popstr (request);
+    if (streq (command, "RECONNECT")) {
+        char *min = zmsg_popstr (request);
+        char *max = zmsg_popstr (request);
+        if (self->started)
+            zsys_error ("RECONNECT: must be set before START");
+        else
+        if (!min || atoi (min) < 1 || (max && atoi (max) < atoi (min)))
+            zsys_error ("RECONNECT: invalid backoff of '%s' to '%s'",
+                min? min: "", max? max: "");
+        else {
+            self->reconnect_min = atoi (min);
+            self->reconnect_max = max? atoi (max): self->reconnect_min;
+        }
+        zstr_free (&min);
+        zstr_free (&max);
+    }
+    else
+    if (streq (command, "MAX-PACKET")) {
+        char *size = zmsg_popstr (request);
+        if (!size || atol (size) < 64)
+            zsys_error ("MAX-PACKET: invalid size of '%s'", size? size: "");
+        else
+            self->max_packet = (size_t) atol (size);
+        zstr_free (&size);
+    }
+    else
+    if (streq (command, "SUBSCRIBE")) {
+        char *name = zmsg_popstr (request);
+        while (name) {
+            s_topic_subscribe (self, name, 0);
+            zstr_free (&name);
+            name = zmsg_popstr (request);
+        }
+    }
+    else
+    if (streq (command, "SUBSCRIBE-QOS")) {
+        //  Strict topic and QoS pairs, otherwise nothing is subscribed
+        bool valid = zmsg_size (request) % 2 == 0;
+        zframe_t *frame = zmsg_first (request);
+        while (valid && frame) {
+            frame = zmsg_next (request);
+            valid = zframe_streq (frame, "0")
+                 || zframe_streq (frame, "1")
+                 || zframe_streq (frame, "2");
+            frame = zmsg_next (request);
+        }
+        if (valid) {
+            char *name = zmsg_popstr (request);
+            while (name) {
+                char *qos = zmsg_popstr (request);
+                s_topic_subscribe (self, name, atoi (qos));
+                zstr_free (&qos);
+                zstr_free (&name);
+                name = zmsg_popstr (request);
+            }
+        }
+        else
+            zsys_error ("SUBSCRIBE-QOS: expected pairs of topic and QoS 0, 1 or 2");
+    }
+    else
+    if (streq (command, "UNSUBSCRIBE")) {
+        char *name = zmsg_popstr (request);
+        while (name) {
+            s_topic_t *topic = s_topic_lookup (self, name);
+            if (topic) {
+                //  Topic never sent to broker needs no UNSUBSCRIBE
+                if (topic->sent) {
+                    s_conn_t *conn = self->conns [s_shard (name, self->shards)];
+                    zlistx_add_end (conn->unsubscribing, name);
+                    s_subscriptions_changed (self);
+                }
+                zlistx_delete (self->topics, zlistx_find (self->topics, topic));
+            }
+            zstr_free (&name);
+            name = zmsg_popstr (request);
         }
     }
     else
+    if (streq (command, "SUBSCRIPTIONS"))
+        s_subscriptions (self);
+    else
     if (streq (command, "PUBLISH")) {
-        char *topic = zmsg_popstr (request);
-        char *qosa = zmsg_popstr (request);
-        char *retaina = zmsg_popstr (request);
-        zframe_t *payload = zmsg_pop (request);
-
-        int qos = 0;
-        switch (qosa [0]) {
-            case '1' : qos = 1; break;
-            case '2' : qos = 2; break;
-        }
-        zstr_free (&qosa);
-
-        bool retain = streq (retaina, "true");
-        zstr_free (&retaina);
-
-        int r = mosquitto_publish (
-            self->mosq,
-            NULL,
-            topic,
-            zframe_size (payload),
-            zframe_data (payload),
-            qos,
-            retain);
-        if (r != MOSQ_ERR_SUCCESS)
-            zsys_warning ("Message on topic %s not published: %s", topic, mosquitto_strerror (r));
-        zframe_destroy (&payload);
-        zstr_free (&topic);
+        //  One record of PUBLISH-MANY, parsed the same way
+        if (zmsg_size (request) == 4)
+            s_publish_many (self, request);
+        else
+            zsys_error ("PUBLISH: expected [topic|qos|retain|payload]");
     }
     else
+    if (streq (command, "PUBLISH-MANY"))
+        s_publish_many (self, request);
+    else
     if (streq (command, "$TERM")) {
         //  The $TERM command is send by zactor_destroy() method
         self->terminated = true;
@@ -305,19 +2693,92 @@ zmosq_server_recv_api (zmosq_server_t *self)
     zmsg_destroy (&request);
 }
 
+//  Pass event [event|shard|...] of connection to the actor. Network loop
+//  sends it on the internal socket with empty frame in front, in LOOP actor
+//  it's handled right away.
+
+static void
+s_event (s_conn_t *conn, zmsg_t **event_p)
+{
+    zmosq_server_t *self = conn->server;
+    if (self->loop == LOOP_ACTOR)
+        s_event_handle (self, conn, event_p);
+    else {
+        zmsg_pushmem (*event_p, NULL, 0);
+        zmsg_send (event_p, conn->mqtt_writter);
+    }
+}
+
 static void
 s_connect (struct mosquitto *mosq, void *obj, int result) {
     assert (obj);
-    zmosq_server_t *self = (zmosq_server_t *) obj;
+    s_conn_t *conn = (s_conn_t *) obj;
+
+    //  Refused connection is reported as disconnected with CONNACK code
+    zmsg_t *event = zmsg_new ();
+    zmsg_addstr (event, result? "$DISCONNECTED": "$CONNECTED");
+    zmsg_addstrf (event, "%zu", conn->index);
+    if (result)
+        zmsg_addstrf (event, "%d", result);
+    else
+        s_count (&conn->connects, 1);
+    s_event (conn, &event);
+}
 
-    if (!result) {
-        char *topic = (char *) zlistx_first (self->topics);
-        while (topic) {
-            int r = mosquitto_subscribe (mosq, NULL, topic, 0);
-            assert (r == MOSQ_ERR_SUCCESS);
-            topic = (char *) zlistx_next (self->topics);
-        }
-    }
+static void
+s_disconnect (struct mosquitto *mosq, void *obj, int result) {
+    assert (obj);
+    s_conn_t *conn = (s_conn_t *) obj;
+    zmsg_t *event = zmsg_new ();
+    zmsg_addstr (event, "$DISCONNECTED");
+    zmsg_addstrf (event, "%zu", conn->index);
+    zmsg_addstrf (event, "%d", result);
+    s_event (conn, &event);
+}
+
+static void
+s_unsubscribe (struct mosquitto *mosq, void *obj, int mid) {
+    assert (obj);
+    s_conn_t *conn = (s_conn_t *) obj;
+    zmsg_t *event = zmsg_new ();
+    zmsg_addstr (event, "$UNSUBACK");
+    zmsg_addstrf (event, "%zu", conn->index);
+    zmsg_addstrf (event, "%d", mid);
+    s_event (conn, &event);
+}
+
+static void
+s_subscribe (struct mosquitto *mosq, void *obj, int mid, int qos_count, const int *granted) {
+    assert (obj);
+    s_conn_t *conn = (s_conn_t *) obj;
+    zmsg_t *event = zmsg_new ();
+    zmsg_addstr (event, "$SUBACK");
+    zmsg_addstrf (event, "%zu", conn->index);
+    zmsg_addstrf (event, "%d", mid);
+    int index;
+    for (index = 0; index < qos_count; index++)
+        zmsg_addstrf (event, "%d", granted [index]);
+    s_event (conn, &event);
+}
+
+//  DIRECT mode: serialize network loops of connections on the data socket
+
+static void
+s_data_lock (zmosq_server_t *self)
+{
+#if defined (__UNIX__)
+    if (self->shards > 1)
+        pthread_mutex_lock (&self->data_mutex);
+#endif
+}
+
+static void
+s_data_unlock (zmosq_server_t *self)
+{
+#if defined (__UNIX__)
+    if (self->shards > 1)
+        pthread_mutex_unlock (&self->data_mutex);
+#endif
 }
 
 static void
@@ -325,16 +2786,77 @@ s_message (struct mosquitto *mosq, void *obj, const struct mosquitto_message *me
 {
 	assert(obj);
 
-    zmosq_server_t *self = (zmosq_server_t*) obj;
+    s_conn_t *conn = (s_conn_t *) obj;
+    zmosq_server_t *self = conn->server;
     assert (self);
-    zsock_t *mqtt_writter = self->mqtt_writter;
-    assert (mqtt_writter);
+
+    s_count (&conn->received, 1);
+    s_count (&conn->received_bytes, (size_t) message->payloadlen);
+    //  Time the message unless another one is on its way to actor, LOOP
+    //  actor delivers it right here and times one in S_PROBE_INTERVAL
+    int64_t probe_at = 0;
+    if (!self->data_writter
+    &&  (self->loop == LOOP_ACTOR
+        ? conn->received % S_PROBE_INTERVAL == 1
+        : zmosq_atomic_load (&conn->probe_seq, ZMOSQ_ACQUIRE) == 0))
+        probe_at = zclock_usecs ();
 
     zmsg_t *msg = zmsg_new ();
-    zmsg_addstr (msg, message->topic);
+    //  In DIRECT mode with INTERN topic id is put in front when sending
+    if (!self->interned || !self->data_writter)
+        zmsg_addstr (msg, message->topic);
     if (message->payload)
         zmsg_addmem (msg, message->payload, message->payloadlen);
-    zmsg_send (&msg, mqtt_writter);
+
+    if (self->data_writter) {
+        //  In DIRECT mode consumer reads messages straight from data socket,
+        //  shared by network loops of all connections
+        //  With LOOP reactor the socket does not wait, what it can't take
+        //  now is dropped
+        s_data_lock (self);
+        if ((self->interned
+        &&   s_intern_push (self, msg, message->topic, self->data_writter) == -1)
+        ||  zmsg_send (&msg, self->data_writter) == -1) {
+            zmsg_destroy (&msg);
+            zmosq_atomic_fetch_add (&conn->dropped, 1);
+        }
+        s_data_unlock (self);
+    }
+    else
+    if (self->loop == LOOP_ACTOR) {
+        //  We are in actor thread already
+        s_deliver (self, &msg);
+        if (probe_at)
+            s_histogram_record (&self->delivery, zclock_usecs () - probe_at);
+    }
+    else
+    if (s_relay_admit (self, conn, msg) == -1)
+        zmsg_destroy (&msg);
+    else {
+        if (conn->ring) {
+            int rc;
+            //  Ring full, wait for actor like zeromq does on HWM, except
+            //  for reactor thread, which would stall other connections
+            while ((rc = zmosq_ring_push (conn->ring, msg)) == -1
+               &&  self->loop != LOOP_REACTOR)
+                zclock_sleep (1);
+            if (rc == -1) {
+                s_relay_undo (self, conn, msg);
+                zmsg_destroy (&msg);
+                return;
+            }
+            if (rc == 1)
+                zstr_send (conn->mqtt_writter, "");
+        }
+        else
+            zmsg_send (&msg, conn->mqtt_writter);
+
+        s_count (&conn->sent, 1);
+        if (probe_at) {
+            conn->probe_at = probe_at;
+            zmosq_atomic_store (&conn->probe_seq, conn->sent, ZMOSQ_RELEASE);
+        }
+    }
 }
 
 //  --------------------------------------------------------------------------
@@ -343,7 +2865,7 @@ s_message (struct mosquitto *mosq, void *obj, const struct mosquitto_message *me
 void
 zmosq_server_actor (zsock_t *pipe, void *args)
 {
-    s_mosquitto_init ();
+    zmosq_broker_mosquitto_init ();
 
     zmosq_server_t * self = zmosq_server_new (pipe, args);
     if (!self)
@@ -352,95 +2874,858 @@ zmosq_server_actor (zsock_t *pipe, void *args)
     //  Signal actor successfully initiated
     zsock_signal (self->pipe, 0);
 
-    mosquitto_connect_callback_set (self->mosq, s_connect);
-	mosquitto_message_callback_set (self->mosq, s_message);
-
-
     while (!self->terminated)
     {
-        void *which = zpoller_wait (self->poller, -1);
+        void *which = zpoller_wait (self->poller, s_poller_timeout (self));
         if (which == pipe)
             zmosq_server_recv_api (self);
+        else
+        if (which && which == self->ingress)
+            s_ingress_drain (self);
+
+        size_t index;
+        for (index = 0; index < self->shards; index++) {
+            s_conn_t *conn = self->conns [index];
+            if (which == conn->mqtt_reader)
+                s_relay (self, conn);
+            else
+            if (conn->ring_pending)
+                s_ring_drain (self, conn);
+
+            if (self->loop == LOOP_ACTOR)
+                s_loop_service (conn, which && which == &conn->socket);
+        }
 
-        if (which == self->mqtt_reader) {
-            zmsg_t *msg = zmsg_recv (self->mqtt_reader);
-            zmsg_send (&msg, pipe);
+        if (self->batch
+        &&  zclock_usecs () - self->batch_started >= self->batch_max_usecs)
+            s_batch_flush (self);
+        s_outbox_flush (self, false);
+        s_start_check (self);
+        //  Changes coming in a burst go out together, steady stream of
+        //  commands does not hold them back past the deadline
+        if (self->subscriptions_deadline
+        &&  (!(zsock_events (self->pipe) & ZMQ_POLLIN)
+        ||   zclock_mono () >= self->subscriptions_deadline))
+            s_subscriptions_flush (self);
+    }
+    s_batch_flush (self);
+
+    zmosq_server_destroy (&self);
+    zmosq_broker_mosquitto_term ();
+}
+
+
+
+//  --------------------------------------------------------------------------
+//  Append binary PUBLISH command to msg. Return 0 if OK, else -1, also when
+//  qos is not 0, 1 or 2.
+
+int
+zmosq_server_publish_append (zmsg_t *msg, const char *topic, int qos, bool retain, const void *payload, size_t size)
+{
+    assert (msg);
+    assert (topic);
+    assert (payload || size == 0);
+    if (qos < 0 || qos > 2)
+        return -1;
+
+    size_t topic_size = strlen (topic);
+    byte header [ZMOSQ_SERVER_HEADER_SIZE] = {
+        0,
+        ZMOSQ_SERVER_OP_PUBLISH,
+        (byte) (qos | (retain? ZMOSQ_SERVER_FLAG_RETAIN: 0)),
+        0,
+        (byte) (topic_size >> 24), (byte) (topic_size >> 16),
+        (byte) (topic_size >> 8),  (byte)  topic_size
+    };
+    zframe_t *body = zframe_new (NULL, topic_size + size);
+    if (!body)
+        return -1;
+    memcpy (zframe_data (body), topic, topic_size);
+    if (size)
+        memcpy (zframe_data (body) + topic_size, payload, size);
+
+    if (zmsg_addmem (msg, header, sizeof (header))
+    ||  zmsg_append (msg, &body)) {
+        zframe_destroy (&body);
+        return -1;
+    }
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Benchmark seams: drive the actor from the calling thread, without broker
+//  and network loop, so the cost of the hot path can be measured alone.
+
+//  Stand-in for mosquitto_publish
+
+static int
+s_bench_publish (
+    mosquitto_t *mosq, int *mid, const char *topic,
+    int payloadlen, const void *payload, int qos, bool retain)
+{
+    return MOSQ_ERR_SUCCESS;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Feed count synthetic MQTT messages with payload of size bytes to the
+//  on_message callback and relay them through the actor to the consumer.
+//  Mode is "thread" (internal socket), "ring", "actor" (LOOP actor) or
+//  "direct". Return nsecs per message, -1 if mode is not known.
+
+double
+zmosq_server_bench_deliver (const char *mode, size_t count, size_t size)
+{
+    assert (mode);
+    zmosq_broker_mosquitto_init ();
+    zsock_t *pipe = zsock_new (ZMQ_PAIR);
+    zsock_t *node = zsock_new (ZMQ_PAIR);
+    assert (pipe && node);
+    char *endpoint = zsys_sprintf ("inproc://zmosq_server_bench_deliver-%p", (void *) pipe);
+    int rc = zsock_bind (pipe, "%s", endpoint);
+    assert (rc != -1);
+    rc = zsock_connect (node, "%s", endpoint);
+    assert (rc != -1);
+    zstr_free (&endpoint);
+    zmosq_server_t *self = zmosq_server_new (pipe, NULL);
+    assert (self);
+
+    zsock_t *consumer = node;
+    zsock_t *direct = NULL;
+    if (streq (mode, "ring"))
+        zstr_sendx (node, "RING", "1024", NULL);
+    else
+    if (streq (mode, "actor"))
+        zstr_sendx (node, "LOOP", "actor", NULL);
+    else
+    if (streq (mode, "direct"))
+        zstr_sendx (node, "DIRECT", NULL);
+    else
+    if (!streq (mode, "thread"))
+        consumer = NULL;
+    if (consumer && !streq (mode, "thread"))
+        zmosq_server_recv_api (self);
+    if (consumer && streq (mode, "direct")) {
+        char *direct_endpoint = zstr_recv (node);
+        assert (direct_endpoint);
+        direct = zsock_new_pair (direct_endpoint);
+        assert (direct);
+        zstr_free (&direct_endpoint);
+        consumer = direct;
+    }
+
+    double nsecs = -1;
+    if (consumer) {
+        s_conn_t *conn = self->conns [0];
+        byte *payload = (byte *) zmalloc (size? size: 1);
+        assert (payload);
+        struct mosquitto_message message;
+        memset (&message, 0, sizeof (message));
+        message.topic = (char *) "zmosq/bench";
+        message.payload = payload;
+        message.payloadlen = (int) size;
+
+        int64_t start = zclock_usecs ();
+        size_t index;
+        for (index = 0; index < count; index++) {
+            s_message (conn->mosq, conn, &message);
+            if (self->loop != LOOP_ACTOR && !self->data_writter) {
+                if (zsock_events (conn->mqtt_reader) & ZMQ_POLLIN)
+                    s_relay (self, conn);
+                else
+                    s_ring_drain (self, conn);
+            }
+            zmsg_t *msg = zmsg_recv (consumer);
+            assert (msg);
+            zmsg_destroy (&msg);
         }
+        nsecs = count? (zclock_usecs () - start) * 1000.0 / count: 0;
+        free (payload);
     }
 
-    mosquitto_lib_cleanup ();
     zmosq_server_destroy (&self);
+    zmosq_broker_mosquitto_term ();
+    zsock_destroy (&direct);
+    zsock_destroy (&node);
+    zsock_destroy (&pipe);
+    return nsecs;
 }
 
 
+//  --------------------------------------------------------------------------
+//  Send count PUBLISH commands with payload of size bytes to the actor and
+//  let it handle them, with a stand-in for mosquitto_publish. Commands are
+//  binary or string ones. Return nsecs per command.
+
+double
+zmosq_server_bench_publish (bool binary, size_t count, size_t size)
+{
+    zmosq_broker_mosquitto_init ();
+    zsock_t *pipe = zsock_new (ZMQ_PAIR);
+    zsock_t *node = zsock_new (ZMQ_PAIR);
+    assert (pipe && node);
+    char *endpoint = zsys_sprintf ("inproc://zmosq_server_bench_publish-%p", (void *) pipe);
+    int rc = zsock_bind (pipe, "%s", endpoint);
+    assert (rc != -1);
+    rc = zsock_connect (node, "%s", endpoint);
+    assert (rc != -1);
+    zstr_free (&endpoint);
+    zmosq_server_t *self = zmosq_server_new (pipe, NULL);
+    assert (self);
+    self->publish = s_bench_publish;
+
+    byte *payload = (byte *) zmalloc (size? size: 1);
+    assert (payload);
+    int64_t start = zclock_usecs ();
+    size_t index;
+    for (index = 0; index < count; index++) {
+        zmsg_t *msg = zmsg_new ();
+        if (binary)
+            rc = zmosq_server_publish_append (msg, "zmosq/bench", 0, false, payload, size);
+        else {
+            rc = zmsg_addstr (msg, "PUBLISH");
+            zmsg_addstr (msg, "zmosq/bench");
+            zmsg_addstr (msg, "0");
+            zmsg_addstr (msg, "false");
+            zmsg_addmem (msg, payload, size);
+        }
+        assert (rc == 0);
+        zmsg_send (&msg, node);
+        zmosq_server_recv_api (self);
+    }
+    double nsecs = count? (zclock_usecs () - start) * 1000.0 / count: 0;
+    assert (self->published == count);
+    free (payload);
+
+    zmosq_server_destroy (&self);
+    zmosq_broker_mosquitto_term ();
+    zsock_destroy (&node);
+    zsock_destroy (&pipe);
+    return nsecs;
+}
+
 
 //  --------------------------------------------------------------------------
 //  Self test of this actor.
 
-// exit on -1
+static int s_test_published = 0;
+
 static int
-s_test_handle_mosquitto (bool verbose, int port)
+s_test_publish (
+    mosquitto_t *mosq, int *mid, const char *topic,
+    int payloadlen, const void *payload, int qos, bool retain)
 {
-    static int child_pid = -1;
+    assert (streq (topic, "TOPIC"));
+    assert (payloadlen == 12);
+    assert (memcmp (payload, "HELLO, FRAME", 12) == 0);
+    assert (qos == 1);
+    assert (retain);
+    s_test_published++;
+    return MOSQ_ERR_SUCCESS;
+}
 
-    if (child_pid > 0) {
-        // we're supposed to kill mosquitto instance
+//  Fixture of tests without broker: actor runs in this thread and test
+//  talks to it through node, the other end of its pipe
 
-        FILE *fp = NULL;
-        char temp_str [1024];
+typedef struct {
+    zsock_t *pipe;              //  Actor end of the pipe
+    zsock_t *node;              //  Test end of the pipe
+    zmosq_server_t *self;       //  Actor under test
+} s_test_t;
 
-        char *cmdline = zsys_sprintf ("ps aux | grep [m]osquitto | grep %d | awk '{print $2}'", port);
-        fp = popen (cmdline, "r");
-        zstr_free (&cmdline);
-        assert (fp);
+//  Create fixture, pipe holds hwm messages on the way to node, 0 = default
 
-        char *frv = fgets (temp_str, sizeof (temp_str), fp);
-        pclose (fp);
-        assert (frv == temp_str);
-        assert (atoi (temp_str) != 0);
+static s_test_t *
+s_test_new (const char *name, int hwm)
+{
+    zmosq_broker_mosquitto_init ();
+    s_test_t *test = (s_test_t *) zmalloc (sizeof (s_test_t));
+    assert (test);
+    test->pipe = zsock_new (ZMQ_PAIR);
+    test->node = zsock_new (ZMQ_PAIR);
+    assert (test->pipe && test->node);
+    if (hwm) {
+        zsock_set_sndhwm (test->pipe, hwm);
+        zsock_set_rcvhwm (test->node, hwm);
+    }
+    int rc = zsock_bind (test->pipe, "inproc://zmosq_server_test_%s", name);
+    assert (rc != -1);
+    rc = zsock_connect (test->node, "inproc://zmosq_server_test_%s", name);
+    assert (rc != -1);
+    test->self = zmosq_server_new (test->pipe, NULL);
+    assert (test->self);
+    return test;
+}
 
-        if (verbose)
-            zsys_debug ("Stopping mosquitto broker.");
-        int rv = kill (atoi (temp_str), SIGKILL);
-        if (rv != 0) 
-            zsys_error ("executing kill (pid = '%d', SIGKILL) failed.", atoi (temp_str));
+static void
+s_test_destroy (s_test_t **test_p)
+{
+    s_test_t *test = *test_p;
+    zmosq_server_destroy (&test->self);
+    zmosq_broker_mosquitto_term ();
+    zsock_destroy (&test->node);
+    zsock_destroy (&test->pipe);
+    free (test);
+    *test_p = NULL;
+}
 
-        return 0;
+//  Fixture of tests with broker: embedded broker on a free port, its
+//  number is returned in port_p
+
+static zmosq_broker_t *
+s_test_broker (char **port_p)
+{
+    zmosq_broker_t *broker = zmosq_broker_new ("tcp://127.0.0.1:*");
+    assert (broker);
+    *port_p = zsys_sprintf ("%d", zmosq_broker_port (broker));
+    assert (*port_p);
+    return broker;
+}
+
+//  New actor connecting to broker on port once it is started
+
+static zactor_t *
+s_test_actor (const char *port)
+{
+    zactor_t *actor = zactor_new (zmosq_server_actor, NULL);
+    assert (actor);
+    zstr_sendx (actor, "CONNECT", "127.0.0.1", port, "10", "127.0.0.1", NULL);
+    return actor;
+}
+
+//  Histogram keeps values within 12.5%
+
+static void
+s_test_histogram (bool verbose)
+{
+    uint64_t value;
+    for (value = 0; value < 1000000; value += value / 8 + 1) {
+        size_t index = s_histogram_index (value);
+        assert (s_histogram_value (index) >= value);
+        assert (s_histogram_value (index) <= value + value / 8);
+        assert (index == 0 || s_histogram_value (index - 1) < value);
     }
+    s_histogram_t *histogram = (s_histogram_t *) zmalloc (sizeof (s_histogram_t));
+    assert (histogram);
+    for (value = 1; value <= 1000; value++)
+        s_histogram_record (histogram, (int64_t) value);
+    uint64_t median = s_histogram_percentile (histogram, 50);
+    assert (median >= 500 && median <= 500 + 500 / 8);
+    assert (s_histogram_percentile (histogram, 100) == 1000);
+    if (verbose)
+        zsys_debug ("histogram: p50 %" PRIu64 ", p99 %" PRIu64,
+            median, s_histogram_percentile (histogram, 99));
+    free (histogram);
+}
 
-    int f = fork ();
-    if (f == 0) {
-        //  child
-        char *cmdline = NULL;
+//  Every hot path of the benchmark seams delivers
+
+static void
+s_test_hot_path (bool verbose)
+{
+    const char *modes [] = { "thread", "ring", "actor", "direct" };
+    size_t index;
+    for (index = 0; index < sizeof (modes) / sizeof (modes [0]); index++) {
+        double nsecs = zmosq_server_bench_deliver (modes [index], 1000, 64);
+        assert (nsecs >= 0);
         if (verbose)
-            cmdline = zsys_sprintf ("mosquitto --verbose -p %d", port);
-        else
-            cmdline = zsys_sprintf ("mosquitto -p %d", port);
+            zsys_debug ("hot path %s: %.0f ns per message", modes [index], nsecs);
+    }
+    assert (zmosq_server_bench_deliver ("nonsense", 1, 1) == -1);
+    assert (zmosq_server_bench_publish (true, 1000, 64) >= 0);
+    assert (zmosq_server_bench_publish (false, 1000, 64) >= 0);
+}
 
-        // upstream mosquitto installs binary to /usr/sbin, which is not in the PATH for most of users
-        // so add /usr/sbin/ there
-        const char* PATH = getenv ("PATH");
-        char* NPATH = zsys_sprintf ("/usr/sbin:%s", PATH);
-        setenv ("PATH", NPATH, 1);
-        zstr_free (&NPATH);
+//  Compare cost of string and binary PUBLISH commands, without broker
 
-        if (verbose)
-            zsys_debug ("Starting mosquitto broker: `%s`", cmdline);
-        int r = system (cmdline);
-        zstr_free (&cmdline);
-        assert (r >= 0);
-        return -1;
+static void
+s_test_command_cost (bool verbose)
+{
+    s_test_t *test = s_test_new ("cost", 0);
+    zmosq_server_t *self = test->self;
+    zsock_t *node = test->node;
+    self->publish = s_test_publish;
+
+    const int count = 10000;
+    int64_t string_usecs = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        zstr_sendx (node, "PUBLISH", "TOPIC", "1", "true", "HELLO, FRAME", NULL);
+        int64_t start = zclock_usecs ();
+        zmosq_server_recv_api (self);
+        string_usecs += zclock_usecs () - start;
+    }
+    assert (s_test_published == count);
+    //  Incomplete command is refused, not published
+    zstr_sendx (node, "PUBLISH", "TOPIC", NULL);
+    zmosq_server_recv_api (self);
+    assert (s_test_published == count);
+
+    int64_t binary_usecs = 0;
+    for (i = 0; i < count; i++) {
+        zmsg_t *msg = zmsg_new ();
+        int r = zmosq_server_publish_append (msg, "TOPIC", 1, true, "HELLO, FRAME", 12);
+        assert (r == 0);
+        zmsg_send (&msg, node);
+        int64_t start = zclock_usecs ();
+        zmosq_server_recv_api (self);
+        binary_usecs += zclock_usecs () - start;
+    }
+    assert (s_test_published == 2 * count);
+    //  Pair with qos 3 is refused, together with the rest of the message
+    zmsg_t *msg = zmsg_new ();
+    assert (zmosq_server_publish_append (msg, "TOPIC", 3, false, "", 0) == -1);
+    assert (zmosq_server_publish_append (msg, "TOPIC", 1, false, "", 0) == 0);
+    assert (zmosq_server_publish_append (msg, "TOPIC", 1, false, "", 0) == 0);
+    zframe_data (zmsg_first (msg)) [2] = 3;
+    zmsg_send (&msg, node);
+    zmosq_server_recv_api (self);
+    assert (s_test_published == 2 * count);
+
+    if (verbose)
+        zsys_debug ("PUBLISH command cost: string %.0f ns, binary %.0f ns",
+            string_usecs * 1000.0 / count, binary_usecs * 1000.0 / count);
+
+    //  Every publish is counted, one in S_PROBE_INTERVAL is timed
+    zstr_send (node, "STATS");
+    zmosq_server_recv_api (self);
+    zmsg_t *reply = zmsg_recv (node);
+    assert (reply);
+    char *name = zmsg_popstr (reply);
+    assert (streq (name, "$STATS"));
+    size_t checked = 0;
+    while (name) {
+        char *value = zmsg_popstr (reply);
+        if (verbose && value)
+            zsys_debug ("STATS: %s = %s", name, value);
+        if (streq (name, "published")) {
+            assert (atoi (value) == 2 * count);
+            checked++;
+        }
+        if (streq (name, "publish_usecs_count")) {
+            assert (atoi (value) == (2 * count + S_PROBE_INTERVAL - 1) / S_PROBE_INTERVAL);
+            checked++;
+        }
+        zstr_free (&name);
+        zstr_free (&value);
+        name = zmsg_popstr (reply);
+    }
+    assert (checked == 2);
+    zmsg_destroy (&reply);
 
+    s_test_destroy (&test);
+}
+
+//  Slow consumer of the pipe makes deliver limit drop oldest messages
+
+static void
+s_test_limit (bool verbose)
+{
+    s_test_t *test = s_test_new ("limit", 1);
+    zmosq_server_t *self = test->self;
+    zsock_t *node = test->node;
+
+    zstr_sendx (node, "LIMIT", "deliver", "2", "0", "drop-oldest", NULL);
+    zmosq_server_recv_api (self);
+    const int count = 100;
+    int i;
+    for (i = 1; i <= count; i++) {
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addstrf (msg, "%d", i);
+        s_send (self, &msg);
     }
-    else
-    if (f > 0) {
-        child_pid = f;
+    assert (zlistx_size (self->outbox) == 2);
+    assert (self->deliver.dropped > 0);
+
+    //  Consumer gets what fitted in the pipe and the newest messages
+    int received = 0, last = 0;
+    while (received + (int) self->deliver.dropped < count) {
+        s_outbox_flush (self, false);
+        char *number = zstr_recv (node);
+        assert (number);
+        assert (atoi (number) > last);
+        last = atoi (number);
+        zstr_free (&number);
+        received++;
     }
-    else {
-        zsys_error ("Failed to fork mosquitto.");
-        exit (EXIT_FAILURE);
+    assert (last == count);
+    if (verbose)
+        zsys_debug ("LIMIT: %d messages received, %d dropped",
+            received, (int) self->deliver.dropped);
+
+    s_test_destroy (&test);
+}
+
+//  Slow consumer with CONFLATE gets the latest value of every topic
+
+static void
+s_test_conflate (bool verbose)
+{
+    s_test_t *test = s_test_new ("conflate", 1);
+    zmosq_server_t *self = test->self;
+    zsock_t *node = test->node;
+
+    zstr_sendx (node, "CONFLATE", NULL);
+    zmosq_server_recv_api (self);
+    const int count = 100;
+    int i;
+    for (i = 1; i <= count; i++) {
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addstr (msg, i % 2? "ODD": "EVEN");
+        zmsg_addstrf (msg, "%d", i);
+        s_send (self, &msg);
     }
-    return 0;
+    //  Outbox holds at most one message per topic
+    assert (zlistx_size (self->outbox) <= 2);
+    assert (zhashx_size (self->conflated) == zlistx_size (self->outbox));
+    assert (self->superseded > 0);
+
+    int received = 0, last_odd = 0, last_even = 0;
+    while (received + (int) self->superseded < count) {
+        s_outbox_flush (self, false);
+        char *topic, *number;
+        int rc = zstr_recvx (node, &topic, &number, NULL);
+        assert (rc == 2);
+        int *last = streq (topic, "ODD")? &last_odd: &last_even;
+        assert (atoi (number) > *last);
+        *last = atoi (number);
+        zstr_free (&topic);
+        zstr_free (&number);
+        received++;
+    }
+    assert (last_odd == count - 1);
+    assert (last_even == count);
+    assert (zhashx_size (self->conflated) == 0);
+
+    zstr_sendx (node, "DROPPED", NULL);
+    zmosq_server_recv_api (self);
+    char *reply, *relay, *deliver, *superseded;
+    int rc = zstr_recvx (node, &reply, &relay, &deliver, &superseded, NULL);
+    assert (rc == 4);
+    assert (streq (reply, "$DROPPED"));
+    if (verbose)
+        zsys_debug ("CONFLATE: %d messages received, %s superseded",
+            received, superseded);
+    assert (atoi (superseded) == count - received);
+    zstr_free (&reply);
+    zstr_free (&relay);
+    zstr_free (&deliver);
+    zstr_free (&superseded);
+
+    s_test_destroy (&test);
+}
+
+//  CACHE answers GET and SNAPSHOT with last values of topics
+
+static void
+s_test_cache (bool verbose)
+{
+    s_test_t *test = s_test_new ("cache", 0);
+    zmosq_server_t *self = test->self;
+    zsock_t *node = test->node;
+
+    zstr_sendx (node, "CACHE", NULL);
+    zmosq_server_recv_api (self);
+    const char *messages [] = {
+        "sensors/1/temp", "20",
+        "sensors/2/temp", "21",
+        "sensors/1/humidity", "40",
+        "sensors/1/temp", "22"
+    };
+    size_t i;
+    for (i = 0; i < sizeof (messages) / sizeof (messages [0]); i += 2) {
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addstr (msg, messages [i]);
+        zmsg_addstr (msg, messages [i + 1]);
+        s_deliver (self, &msg);
+        msg = zmsg_recv (node);
+        assert (msg);
+        zmsg_destroy (&msg);
+    }
+    assert (zhashx_size (self->cache) == 3);
+
+    zstr_sendx (node, "GET", "sensors/1/temp", NULL);
+    zmosq_server_recv_api (self);
+    char *reply, *topic, *received, *payload;
+    int rc = zstr_recvx (node, &reply, &topic, &received, &payload, NULL);
+    assert (rc == 4);
+    assert (streq (reply, "$VALUE"));
+    assert (streq (topic, "sensors/1/temp"));
+    assert (atoll (received) > 0);
+    assert (streq (payload, "22"));
+    zstr_free (&reply);
+    zstr_free (&topic);
+    zstr_free (&received);
+    zstr_free (&payload);
+
+    zstr_sendx (node, "GET", "sensors/3/temp", NULL);
+    zmosq_server_recv_api (self);
+    zmsg_t *msg = zmsg_recv (node);
+    assert (msg);
+    assert (zmsg_size (msg) == 2);
+    zmsg_destroy (&msg);
+
+    zstr_sendx (node, "SNAPSHOT", "sensors/+/temp", NULL);
+    zmosq_server_recv_api (self);
+    msg = zmsg_recv (node);
+    assert (msg);
+    if (verbose)
+        zmsg_print (msg);
+    assert (zmsg_size (msg) == 1 + 2 * 3);
+    char *command = zmsg_popstr (msg);
+    assert (streq (command, "$SNAPSHOT"));
+    zstr_free (&command);
+    zmsg_destroy (&msg);
+
+    s_test_destroy (&test);
+}
+
+//  START gives up when broker does not answer in time
+
+static void
+s_test_start_timeout (bool verbose)
+{
+    //  Plain TCP listener accepts connections but never writes a byte, so
+    //  CONNACK never comes
+    SOCKET silent = socket (AF_INET, SOCK_STREAM, 0);
+    assert (silent != INVALID_SOCKET);
+    struct sockaddr_in address;
+    memset (&address, 0, sizeof (address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    int rc = bind (silent, (struct sockaddr *) &address, sizeof (address));
+    assert (rc == 0);
+    rc = listen (silent, 8);
+    assert (rc == 0);
+    socklen_t address_len = sizeof (address);
+    rc = getsockname (silent, (struct sockaddr *) &address, &address_len);
+    assert (rc == 0);
+    char *port_text = zsys_sprintf ("%d", ntohs (address.sin_port));
+
+    zactor_t *server = s_test_actor (port_text);
+    if (verbose)
+        zstr_sendx (server, "VERBOSE", NULL);
+    zstr_sendx (server, "SUBSCRIBE", "TEST", NULL);
+    int64_t start = zclock_mono ();
+    zstr_sendx (server, "START", "100", NULL);
+    char *reply, *status;
+    zstr_recvx (server, &reply, &status, NULL);
+    assert (streq (reply, "$STARTED"));
+    assert (streq (status, "TIMEOUT"));
+    assert (zclock_mono () - start >= 100);
+    zstr_free (&reply);
+    zstr_free (&status);
+
+    zactor_destroy (&server);
+    zstr_free (&port_text);
+    closesocket (silent);
+}
+
+//  Receive event from actor and check its name and number of frames
+
+static void
+s_test_event (zactor_t *actor, const char *name, size_t size)
+{
+    zmsg_t *event = zmsg_recv (actor);
+    assert (event);
+    assert (zframe_streq (zmsg_first (event), name));
+    assert (zmsg_size (event) == size);
+    zmsg_destroy (&event);
+}
+
+//  Wait until actor reports START succeeded
+
+static void
+s_test_started (zactor_t *actor)
+{
+    char *reply, *status;
+    zstr_recvx (actor, &reply, &status, NULL);
+    assert (streq (reply, "$STARTED"));
+    assert (streq (status, "OK"));
+    zstr_free (&reply);
+    zstr_free (&status);
+}
+
+//  Start actor without EVENTS and wait until it's up
+
+static void
+s_test_start (zactor_t *actor)
+{
+    zstr_sendx (actor, "START", "5000", NULL);
+    s_test_started (actor);
+}
+
+//  Each delivery mode on its own, publisher and subscriber in the same mode
+
+static void
+s_test_modes (bool verbose)
+{
+    char *port;
+    zmosq_broker_t *broker = s_test_broker (&port);
+
+    const char *modes [][3] = {
+        { "RING", "16", NULL },
+        { "LOOP", "actor", NULL },
+        { "LOOP", "reactor", "2" }
+    };
+    size_t index;
+    for (index = 0; index < sizeof (modes) / sizeof (modes [0]); index++) {
+        if (verbose)
+            zsys_debug ("zmosq_server: mode %s %s", modes [index][0],
+                modes [index][1]? modes [index][1]: "");
+        zactor_t *actors [2];
+        int actor_nbr;
+        for (actor_nbr = 0; actor_nbr < 2; actor_nbr++) {
+            actors [actor_nbr] = s_test_actor (port);
+            zstr_sendx (actors [actor_nbr],
+                modes [index][0], modes [index][1], modes [index][2], NULL);
+            if (actor_nbr == 0)
+                zstr_sendx (actors [actor_nbr], "SUBSCRIBE", "MODE", NULL);
+            s_test_start (actors [actor_nbr]);
+        }
+        int i;
+        for (i = 0; i < 20; i++)
+            zstr_sendx (actors [1], "PUBLISH", "MODE", "0", "false", "HELLO, MODE", NULL);
+        for (i = 0; i < 20; i++) {
+            char *topic, *body;
+            zstr_recvx (actors [0], &topic, &body, NULL);
+            assert (streq (topic, "MODE"));
+            assert (streq (body, "HELLO, MODE"));
+            zstr_free (&topic);
+            zstr_free (&body);
+        }
+        zactor_destroy (&actors [1]);
+        zactor_destroy (&actors [0]);
+    }
+    zmosq_broker_destroy (&broker);
+    zstr_free (&port);
+}
+
+//  Topics are subscribed in packets of MAX-PACKET bytes, again after
+//  broker comes back
+
+static void
+s_test_resubscribe (bool verbose)
+{
+    char *port;
+    zmosq_broker_t *broker = s_test_broker (&port);
+    char *endpoint = strdup (zmosq_broker_endpoint (broker));
+
+    zactor_t *server = s_test_actor (port);
+    zstr_sendx (server, "LOOP", "actor", NULL);
+    zstr_sendx (server, "RECONNECT", "50", "200", NULL);
+    //  Each topic takes 12 bytes, so 10 fit in 128 byte packet
+    zstr_sendx (server, "MAX-PACKET", "128", NULL);
+    zstr_sendx (server, "EVENTS", NULL);
+    zmsg_t *subscribe = zmsg_new ();
+    zmsg_addstr (subscribe, "SUBSCRIBE");
+    int index;
+    for (index = 0; index < 100; index++)
+        zmsg_addstrf (subscribe, "TOPIC/%03d", index);
+    zmsg_send (&subscribe, server);
+    zstr_sendx (server, "START", "5000", NULL);
+
+    int round;
+    for (round = 0; round < 2; round++) {
+        char *event, *shard, *packets;
+        zstr_recvx (server, &event, &shard, &packets, NULL);
+        assert (streq (event, "$CONNECTED"));
+        assert (streq (packets, "10"));
+        zstr_free (&event);
+        zstr_free (&shard);
+        zstr_free (&packets);
+        for (index = 0; index < 10; index++)
+            s_test_event (server, "$SUBACK", 3 + 2 * 10);
+        if (round == 0) {
+            s_test_started (server);
+            //  Broker restarts on the same port
+            zmosq_broker_destroy (&broker);
+            s_test_event (server, "$DISCONNECTED", 3);
+            broker = zmosq_broker_new (endpoint);
+            assert (broker);
+        }
+    }
+
+    zactor_destroy (&server);
+    zmosq_broker_destroy (&broker);
+    zstr_free (&port);
+    zstr_free (&endpoint);
+}
+
+//  SUBSCRIBE and UNSUBSCRIBE are applied to running session
+
+static void
+s_test_live_subscribe (bool verbose)
+{
+    char *port;
+    zmosq_broker_t *broker = s_test_broker (&port);
+
+    zactor_t *server = s_test_actor (port);
+    zstr_sendx (server, "EVENTS", NULL);
+    zstr_sendx (server, "SUBSCRIBE", "live/a", NULL);
+    zstr_sendx (server, "START", "5000", NULL);
+    s_test_event (server, "$CONNECTED", 3);
+    s_test_event (server, "$SUBACK", 3 + 2);
+    s_test_started (server);
+
+    zactor_t *publisher = s_test_actor (port);
+    s_test_start (publisher);
+
+    //  Topics of one command share a packet
+    zstr_sendx (server, "SUBSCRIBE", "live/b", "live/c", NULL);
+    s_test_event (server, "$SUBACK", 3 + 2 * 2);
+    zstr_sendx (server, "UNSUBSCRIBE", "live/a", "live/unknown", NULL);
+    s_test_event (server, "$UNSUBACK", 3 + 1);
+
+    zstr_sendx (publisher, "PUBLISH", "live/a", "0", "false", "A", NULL);
+    zstr_sendx (publisher, "PUBLISH", "live/b", "0", "false", "B", NULL);
+    char *topic, *payload;
+    zstr_recvx (server, &topic, &payload, NULL);
+    assert (streq (topic, "live/b"));
+    assert (streq (payload, "B"));
+    zstr_free (&topic);
+    zstr_free (&payload);
+
+    //  Steady stream of commands does not hold changes back
+    zstr_sendx (server, "SUBSCRIBE", "live/d", NULL);
+    int64_t started = zclock_mono ();
+    while (!(zsock_events (server) & ZMQ_POLLIN)
+       &&  zclock_mono () - started < 2000)
+        zstr_sendx (server, "PUBLISH", "live/noise", "0", "false", "N", NULL);
+    assert (zclock_mono () - started < 2000);
+    s_test_event (server, "$SUBACK", 3 + 2);
+
+    //  QoS goes in its own command, "1" is just a topic for SUBSCRIBE
+    zstr_sendx (server, "SUBSCRIBE", "live/e", "1", NULL);
+    s_test_event (server, "$SUBACK", 3 + 2 * 2);
+    //  Broken pairs are refused as a whole
+    zstr_sendx (server, "SUBSCRIBE-QOS", "live/f", "1", "live/g", NULL);
+    zstr_sendx (server, "SUBSCRIBE-QOS", "live/f", "3", NULL);
+    zstr_sendx (server, "SUBSCRIBE-QOS", "live/e", "1", NULL);
+    zmsg_t *reply = zmsg_recv (server);
+    assert (reply);
+    assert (zmsg_size (reply) == 3 + 2);
+    assert (zframe_streq (zmsg_first (reply), "$SUBACK"));
+    zmsg_next (reply);
+    zmsg_next (reply);
+    assert (zframe_streq (zmsg_next (reply), "live/e"));
+    assert (zframe_streq (zmsg_next (reply), "1"));
+    zmsg_destroy (&reply);
+
+    zstr_sendx (server, "SUBSCRIPTIONS", NULL);
+    reply = zmsg_recv (server);
+    assert (reply);
+    if (verbose)
+        zmsg_print (reply);
+    assert (zmsg_size (reply) == 1 + 5 * 3);
+    zmsg_destroy (&reply);
+
+    zactor_destroy (&publisher);
+    zactor_destroy (&server);
+    zmosq_broker_destroy (&broker);
+    zstr_free (&port);
 }
 
 void
@@ -449,15 +3734,20 @@ zmosq_server_test (bool verbose)
     printf (" * zmosq_server:\n");
     fflush (stdout);
 
-    int PORT = 0;
-    char *PORTA = NULL;
-    srand (time (NULL));
-    PORT = 1024 + (rand () % 4096);
-
-    if (s_test_handle_mosquitto (verbose, PORT) == -1)
-        return;
-    PORTA = zsys_sprintf ("%d", PORT);
-    zclock_sleep (3000);    // helps broker to initialize
+    s_test_command_cost (verbose);
+    s_test_histogram (verbose);
+    s_test_hot_path (verbose);
+    s_test_limit (verbose);
+    s_test_conflate (verbose);
+    s_test_cache (verbose);
+    s_test_start_timeout (verbose);
+    s_test_resubscribe (verbose);
+    s_test_live_subscribe (verbose);
+    s_test_modes (verbose);
+
+    //  Embedded broker stand-in on a free port
+    char *PORTA;
+    zmosq_broker_t *broker = s_test_broker (&PORTA);
 
     //  @selftest
     //  Simple create/destroy test
@@ -465,21 +3755,149 @@ zmosq_server_test (bool verbose)
     zactor_t *zmosq_server = zactor_new (zmosq_server_actor, NULL);
     zstr_sendx (zmosq_server, "CONNECT", "127.0.0.1", PORTA, "10", "127.0.0.1", NULL);
     zstr_sendx (zmosq_server, "SUBSCRIBE", "TEST", "TEST2", "TOPIC", "SOME MORE", NULL);
-    zstr_sendx (zmosq_server, "START", NULL);
-
-    zactor_t *zmosq_pub = zactor_new (zmosq_server_actor, NULL);
-    zstr_sendx (zmosq_pub, "CONNECT", "127.0.0.1", PORTA, "10", "127.0.0.1", NULL);
-    zstr_sendx (zmosq_pub, "START", NULL);
-    zclock_sleep (3000); // helps actor to estabilish connection to broker
+    zstr_sendx (zmosq_server, "START", "5000", NULL);
+
+    //  Direct delivery, consumer reads from dedicated data socket
+    zactor_t *zmosq_direct = s_test_actor (PORTA);
+    zstr_sendx (zmosq_direct, "DIRECT", NULL);
+    char *direct_endpoint = zstr_recv (zmosq_direct);
+    assert (direct_endpoint);
+    zsock_t *direct = zsock_new_pair (direct_endpoint);
+    assert (direct);
+    zstr_free (&direct_endpoint);
+    zstr_sendx (zmosq_direct, "SUBSCRIBE-QOS", "TOPIC", "1", NULL);
+    zstr_sendx (zmosq_direct, "EVENTS", NULL);
+    zstr_sendx (zmosq_direct, "START", "5000", NULL);
+
+    //  Batched delivery, whole burst flushed after 100ms at latest, with
+    //  topics replaced by ids
+    zactor_t *zmosq_batch = s_test_actor (PORTA);
+    zstr_sendx (zmosq_batch, "BATCH", "100", "0", "100000", NULL);
+    zstr_sendx (zmosq_batch, "INTERN", NULL);
+    zstr_sendx (zmosq_batch, "LOOP", "actor", NULL);
+    zstr_sendx (zmosq_batch, "SUBSCRIBE", "TEST", NULL);
+    zstr_sendx (zmosq_batch, "START", "5000", NULL);
+
+    //  Topics spread over two connections, fanned in to one pipe, except
+    //  for TOPIC which is routed to its own socket
+    zsock_t *route = zsock_new_pull ("@inproc://zmosq_server_test_route");
+    assert (route);
+    zactor_t *zmosq_sharded = s_test_actor (PORTA);
+    zstr_sendx (zmosq_sharded, "SHARDS", "2", NULL);
+    zstr_sendx (zmosq_sharded, "ROUTE", "TOPIC/#", ">inproc://zmosq_server_test_route", NULL);
+    //  Overlapping pattern on the same socket does not duplicate messages
+    zstr_sendx (zmosq_sharded, "ROUTE", "TOPIC", ">inproc://zmosq_server_test_route", NULL);
+    zstr_sendx (zmosq_sharded, "SUBSCRIBE", "TEST", "TOPIC", NULL);
+    zstr_sendx (zmosq_sharded, "START", "5000", NULL);
+
+    //  Published on PUB socket, subscriber filters by topic prefix
+    zactor_t *zmosq_pubsub = s_test_actor (PORTA);
+    zstr_sendx (zmosq_pubsub, "PUB", "tcp://127.0.0.1:*", NULL);
+    char *pub_endpoint = zstr_recv (zmosq_pubsub);
+    assert (pub_endpoint && *pub_endpoint);
+    zsock_t *sub = zsock_new_sub (pub_endpoint, "TOP");
+    assert (sub);
+    zstr_free (&pub_endpoint);
+    zstr_sendx (zmosq_pubsub, "SUBSCRIBE", "TEST", "TOPIC", NULL);
+    zstr_sendx (zmosq_pubsub, "START", "5000", NULL);
+
+#if defined (HAVE_MALAMUTE)
+    //  Forwarded to malamute stream, MQTT topic is the subject
+    zactor_t *mlm_broker = zactor_new (mlm_server, "Server");
+    assert (mlm_broker);
+    zstr_sendx (mlm_broker, "BIND", "inproc://zmosq_server_test_mlm", NULL);
+    mlm_client_t *mlm_consumer = mlm_client_new ();
+    assert (mlm_consumer);
+    int rv = mlm_client_connect (mlm_consumer, "inproc://zmosq_server_test_mlm", 1000, "consumer");
+    assert (rv == 0);
+    rv = mlm_client_set_consumer (mlm_consumer, "MQTT", ".*");
+    assert (rv == 0);
+    zactor_t *zmosq_mlm = s_test_actor (PORTA);
+    zstr_sendx (zmosq_mlm, "BATCH", "100", "0", "1000", NULL);
+    zstr_sendx (zmosq_mlm, "MLM-CONNECT", "inproc://zmosq_server_test_mlm", NULL);
+    zstr_sendx (zmosq_mlm, "MLM-PUBLISH", "MQTT", NULL);
+    zstr_sendx (zmosq_mlm, "SUBSCRIBE", "TOPIC", NULL);
+    zstr_sendx (zmosq_mlm, "START", "5000", NULL);
+#endif
+
+    zactor_t *zmosq_pub = s_test_actor (PORTA);
+    zstr_sendx (zmosq_pub, "INGRESS", "inproc://zmosq_server_test_ingress", NULL);
+    char *ingress_endpoint = zstr_recv (zmosq_pub);
+    assert (ingress_endpoint && streq (ingress_endpoint, "inproc://zmosq_server_test_ingress"));
+    zstr_free (&ingress_endpoint);
+    zsock_t *ingress = zsock_new_push (">inproc://zmosq_server_test_ingress");
+    assert (ingress);
+    zstr_sendx (zmosq_pub, "START", "5000", NULL);
+
+    //  Connection comes up and the subscription is acknowledged with QoS
+    //  granted before direct actor reports it has started
+    char *event, *shard, *count;
+    zstr_recvx (zmosq_direct, &event, &shard, &count, NULL);
+    assert (streq (event, "$CONNECTED"));
+    assert (streq (shard, "0"));
+    assert (streq (count, "1"));
+    zstr_free (&event);
+    zstr_free (&shard);
+    zstr_free (&count);
+    zmsg_t *suback = zmsg_recv (zmosq_direct);
+    assert (suback);
+    assert (zmsg_size (suback) == 5);
+    event = zmsg_popstr (suback);
+    assert (streq (event, "$SUBACK"));
+    zstr_free (&event);
+    zmsg_first (suback);        //  shard
+    zmsg_next (suback);         //  mid
+    assert (zframe_streq (zmsg_next (suback), "TOPIC"));
+    assert (zframe_streq (zmsg_next (suback), "1"));
+    zmsg_destroy (&suback);
+    s_test_started (zmosq_direct);
+
+    char *reply, *qos, *granted;
+    zstr_sendx (zmosq_direct, "SUBSCRIPTIONS", NULL);
+    zstr_recvx (zmosq_direct, &reply, &event, &qos, &granted, NULL);
+    assert (streq (reply, "$SUBSCRIPTIONS"));
+    assert (streq (event, "TOPIC"));
+    assert (streq (qos, "1"));
+    assert (streq (granted, "1"));
+    zstr_free (&reply);
+    zstr_free (&event);
+    zstr_free (&qos);
+    zstr_free (&granted);
+
+    s_test_started (zmosq_server);
+    s_test_started (zmosq_batch);
+    s_test_started (zmosq_sharded);
+    s_test_started (zmosq_pubsub);
+#if defined (HAVE_MALAMUTE)
+    s_test_started (zmosq_mlm);
+#endif
+    s_test_started (zmosq_pub);
 
     int i = 0;
 
-    for (i = 0; i < 20; i++) {
+    for (i = 0; i < 10; i++) {
         zstr_sendx (zmosq_pub, "PUBLISH", (i % 2 == 0) ? "TOPIC" : "TEST", "0", "false", "HELLO, FRAME", NULL);
     }
+    zmsg_t *many = zmsg_new ();
+    zmsg_addstr (many, "PUBLISH-MANY");
+    for (i = 10; i < 20; i++) {
+        zmsg_addstr (many, (i % 2 == 0) ? "TOPIC" : "TEST");
+        zmsg_addstr (many, "0");
+        zmsg_addstr (many, "false");
+        zmsg_addstr (many, "HELLO, FRAME");
+    }
+    zmsg_send (&many, zmosq_pub);
+    //  Binary encoded commands can be mixed with string ones
+    zmsg_t *binary = zmsg_new ();
+    zmosq_server_publish_append (binary, "TOPIC", 0, false, "HELLO, FRAME", 12);
+    zmosq_server_publish_append (binary, "TEST", 0, false, "HELLO, FRAME", 12);
+    zmsg_send (&binary, zmosq_pub);
+    //  Producers can publish through ingress socket, bypassing the pipe
+    zstr_sendx (ingress, "TOPIC", "0", "false", "HELLO, FRAME", NULL);
+    zstr_sendx (ingress, "TEST", "0", "false", "HELLO, FRAME", NULL);
     zclock_sleep (500);
 
-    for (i = 0; i < 20; i++) {
+    for (i = 0; i < 24; i++) {
         zmsg_t *msg = zmsg_recv (zmosq_server);
         assert (msg);
         char *topic, *body;
@@ -494,12 +3912,110 @@ zmosq_server_test (bool verbose)
         zstr_free (&body);
         zmsg_destroy (&msg);
     }
-    
+
+    for (i = 0; i < 12; i++) {
+        zmsg_t *msg = zmsg_recv (direct);
+        assert (msg);
+        char *topic = zmsg_popstr (msg);
+        assert (streq (topic, "TOPIC"));
+        zstr_free (&topic);
+        zmsg_destroy (&msg);
+    }
+
+    //  Topic is announced once, before its id is used
+    zmsg_t *announce = zmsg_recv (zmosq_batch);
+    assert (announce);
+    assert (zmsg_size (announce) == 3);
+    char *command = zmsg_popstr (announce);
+    assert (streq (command, "$TOPIC"));
+    zstr_free (&command);
+    zframe_t *topic_id = zmsg_pop (announce);
+    assert (zframe_size (topic_id) == 4);
+    char *topic_name = zmsg_popstr (announce);
+    assert (streq (topic_name, "TEST"));
+    zstr_free (&topic_name);
+    zmsg_destroy (&announce);
+
+    int batched = 0;
+    while (batched < 12) {
+        zmsg_t *msg = zmsg_recv (zmosq_batch);
+        assert (msg);
+        assert (zmsg_size (msg) % 2 == 0);
+        while (zmsg_size (msg) > 0) {
+            zframe_t *id = zmsg_pop (msg);
+            char *body = zmsg_popstr (msg);
+            assert (zframe_eq (id, topic_id));
+            assert (streq (body, "HELLO, FRAME"));
+            zframe_destroy (&id);
+            zstr_free (&body);
+            batched++;
+        }
+        zmsg_destroy (&msg);
+    }
+    zframe_destroy (&topic_id);
+    assert (batched == 12);
+    zactor_destroy (&zmosq_batch);
+
+    for (i = 0; i < 12; i++) {
+        zmsg_t *msg = zmsg_recv (zmosq_sharded);
+        assert (msg);
+        char *topic = zmsg_popstr (msg);
+        assert (streq (topic, "TEST"));
+        zstr_free (&topic);
+        zmsg_destroy (&msg);
+
+        msg = zmsg_recv (route);
+        assert (msg);
+        topic = zmsg_popstr (msg);
+        assert (streq (topic, "TOPIC"));
+        zstr_free (&topic);
+        zmsg_destroy (&msg);
+    }
+    zactor_destroy (&zmosq_sharded);
+    assert (!(zsock_events (route) & ZMQ_POLLIN));
+    zsock_destroy (&route);
+
+    for (i = 0; i < 12; i++) {
+        zmsg_t *msg = zmsg_recv (sub);
+        assert (msg);
+        char *topic = zmsg_popstr (msg);
+        assert (streq (topic, "TOPIC"));
+        zstr_free (&topic);
+        zmsg_destroy (&msg);
+    }
+    zsock_destroy (&sub);
+    zactor_destroy (&zmosq_pubsub);
+
+#if defined (HAVE_MALAMUTE)
+    //  Batched payloads of a topic share one stream message
+    size_t payloads = 0;
+    while (payloads < 12) {
+        zmsg_t *msg = mlm_client_recv (mlm_consumer);
+        assert (msg);
+        assert (streq (mlm_client_subject (mlm_consumer), "TOPIC"));
+        char *body = zmsg_popstr (msg);
+        while (body) {
+            assert (streq (body, "HELLO, FRAME"));
+            zstr_free (&body);
+            payloads++;
+            body = zmsg_popstr (msg);
+        }
+        zmsg_destroy (&msg);
+    }
+    assert (payloads == 12);
+    zactor_destroy (&zmosq_mlm);
+    mlm_client_destroy (&mlm_consumer);
+    zactor_destroy (&mlm_broker);
+#endif
+
+    zsock_destroy (&direct);
+    zactor_destroy (&zmosq_direct);
+    zsock_destroy (&ingress);
     zactor_destroy (&zmosq_pub);
     zactor_destroy (&zmosq_server);
     //  @end
     zstr_free (&PORTA);
-    s_test_handle_mosquitto (verbose, PORT);
+    zmosq_broker_destroy (&broker);
 
     printf ("OK\n");
 }
@@ -0,0 +1,426 @@
+/*  =========================================================================
+    zmosq_trie - Matcher of MQTT topics against wildcard patterns
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+    This file is part of the Malamute Project.                         
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+/*
+@header
+    zmosq_trie - Matcher of MQTT topics against wildcard patterns
+@discuss
+Patterns are split on "/" into levels and every level is an edge of the
+trie. All edges live in one hash table keyed by parent node and level, so
+a node costs the same however many children it has. Matching a topic takes
+one lookup per level, plus one for every "+" branch on the way, no matter
+how many patterns there are.
+@end
+*/
+
+#include "zmsq_classes.h"
+
+typedef struct _s_node_t s_node_t;
+
+//  Node of the trie, reached from its parent by one level
+struct _s_node_t {
+    zlistx_t *items;            //  Items of patterns ending here, or NULL
+    zlistx_t *rest;             //  Items of patterns ending by "#" here, or NULL
+};
+
+//  Key of an edge of the trie
+typedef struct {
+    s_node_t *parent;           //  Node the edge leads from
+    const char *level;          //  Level of pattern, "+" for wildcard
+} s_edge_t;
+
+//  Structure of our class
+
+struct _zmosq_trie_t {
+    s_node_t root;              //  Node of empty pattern
+    zhashx_t *edges;            //  Child s_node_t by s_edge_t
+    size_t size;                //  Number of patterns
+    char *buffer;               //  Pattern or topic split into levels
+    size_t buffer_size;         //  Allocated size of buffer
+    char **levels;              //  Levels, pointing into buffer
+    size_t levels_size;         //  Allocated size of levels
+    size_t lookups;             //  Edge lookups done by last match
+};
+
+
+//  Edge keys are copied into one block with their level
+
+static void *
+s_edge_dup (const void *key)
+{
+    const s_edge_t *edge = (const s_edge_t *) key;
+    size_t size = strlen (edge->level) + 1;
+    s_edge_t *copy = (s_edge_t *) malloc (sizeof (s_edge_t) + size);
+    if (copy) {
+        memcpy (copy + 1, edge->level, size);
+        copy->parent = edge->parent;
+        copy->level = (const char *) (copy + 1);
+    }
+    return copy;
+}
+
+static void
+s_edge_free (void **key_p)
+{
+    free (*key_p);
+    *key_p = NULL;
+}
+
+static int
+s_edge_compare (const void *key1, const void *key2)
+{
+    const s_edge_t *edge1 = (const s_edge_t *) key1;
+    const s_edge_t *edge2 = (const s_edge_t *) key2;
+    if (edge1->parent != edge2->parent)
+        return edge1->parent < edge2->parent? -1: 1;
+    return strcmp (edge1->level, edge2->level);
+}
+
+//  FNV-1a of the level, seeded by the parent node
+
+static size_t
+s_edge_hash (const void *key)
+{
+    const s_edge_t *edge = (const s_edge_t *) key;
+    size_t hash = 2166136261u ^ ((uintptr_t) edge->parent >> 4);
+    const char *level = edge->level;
+    while (*level) {
+        hash ^= (byte) *level++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void
+s_node_free (void **item_p)
+{
+    s_node_t *node = (s_node_t *) *item_p;
+    if (node) {
+        zlistx_destroy (&node->items);
+        zlistx_destroy (&node->rest);
+        free (node);
+        *item_p = NULL;
+    }
+}
+
+
+//  --------------------------------------------------------------------------
+//  Create a new empty trie
+
+zmosq_trie_t *
+zmosq_trie_new (void)
+{
+    zmosq_trie_t *self = (zmosq_trie_t *) zmalloc (sizeof (zmosq_trie_t));
+    if (!self)
+        return NULL;
+
+    self->edges = zhashx_new ();
+    if (!self->edges) {
+        zmosq_trie_destroy (&self);
+        return NULL;
+    }
+    zhashx_set_key_duplicator (self->edges, s_edge_dup);
+    zhashx_set_key_destructor (self->edges, s_edge_free);
+    zhashx_set_key_comparator (self->edges, s_edge_compare);
+    zhashx_set_key_hasher (self->edges, s_edge_hash);
+    zhashx_set_destructor (self->edges, s_node_free);
+    return self;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Destroy the trie, items are not touched
+
+void
+zmosq_trie_destroy (zmosq_trie_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zmosq_trie_t *self = *self_p;
+        zhashx_destroy (&self->edges);
+        zlistx_destroy (&self->root.items);
+        zlistx_destroy (&self->root.rest);
+        free (self->buffer);
+        free (self->levels);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+
+//  Split text on "/" into self->levels. Return number of levels, 0 if
+//  there is no memory.
+
+static size_t
+s_split (zmosq_trie_t *self, const char *text)
+{
+    size_t size = strlen (text) + 1;
+    if (size > self->buffer_size) {
+        char *buffer = (char *) realloc (self->buffer, size);
+        if (!buffer)
+            return 0;
+        self->buffer = buffer;
+        self->buffer_size = size;
+    }
+    memcpy (self->buffer, text, size);
+
+    size_t count = 0;
+    char *level = self->buffer;
+    while (true) {
+        if (count == self->levels_size) {
+            size_t levels_size = self->levels_size? self->levels_size * 2: 16;
+            char **levels = (char **) realloc (self->levels, levels_size * sizeof (char *));
+            if (!levels)
+                return 0;
+            self->levels = levels;
+            self->levels_size = levels_size;
+        }
+        self->levels [count++] = level;
+        char *slash = strchr (level, '/');
+        if (!slash)
+            break;
+        *slash = 0;
+        level = slash + 1;
+    }
+    return count;
+}
+
+
+//  Add item to list, creating the list if needed. Return 0 if OK, else -1.
+
+static int
+s_items_add (zlistx_t **items_p, void *item)
+{
+    if (!*items_p)
+        *items_p = zlistx_new ();
+    if (!*items_p || !zlistx_add_end (*items_p, item))
+        return -1;
+    return 0;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Add item for MQTT subscription pattern, "+" matches one level and "#"
+//  as the last level matches any number of levels. Return 0 if OK, -1 if
+//  the pattern is not valid.
+
+int
+zmosq_trie_insert (zmosq_trie_t *self, const char *pattern, void *item)
+{
+    assert (self);
+    assert (pattern);
+    if (*pattern == 0)
+        return -1;
+    size_t count = s_split (self, pattern);
+    if (count == 0)
+        return -1;
+
+    //  Wildcards must take whole level, "#" only the last one
+    size_t index;
+    for (index = 0; index < count; index++) {
+        const char *level = self->levels [index];
+        if ((strchr (level, '+') && !streq (level, "+"))
+        ||  (strchr (level, '#') && (!streq (level, "#") || index + 1 < count)))
+            return -1;
+    }
+
+    s_node_t *node = &self->root;
+    for (index = 0; index < count; index++) {
+        const char *level = self->levels [index];
+        if (streq (level, "#")) {
+            if (s_items_add (&node->rest, item))
+                return -1;
+            self->size++;
+            return 0;
+        }
+        s_edge_t edge = { node, level };
+        s_node_t *child = (s_node_t *) zhashx_lookup (self->edges, &edge);
+        if (!child) {
+            child = (s_node_t *) zmalloc (sizeof (s_node_t));
+            if (!child)
+                return -1;
+            if (zhashx_insert (self->edges, &edge, child)) {
+                free (child);
+                return -1;
+            }
+        }
+        node = child;
+    }
+    if (s_items_add (&node->items, item))
+        return -1;
+    self->size++;
+    return 0;
+}
+
+
+//  Call fn for every item of the list, return number of items
+
+static size_t
+s_items_call (zlistx_t *items, zmosq_trie_match_fn *fn, void *arg)
+{
+    void *item = zlistx_first (items);
+    while (item) {
+        if (fn)
+            fn (item, arg);
+        item = zlistx_next (items);
+    }
+    return zlistx_size (items);
+}
+
+
+//  Match self->levels from depth on, starting at node
+
+static size_t
+s_match (zmosq_trie_t *self, s_node_t *node, size_t depth, size_t count, zmosq_trie_match_fn *fn, void *arg)
+{
+    size_t matched = 0;
+    //  Wildcard at first level does not match topics starting with "$"
+    bool wildcard = depth > 0 || self->levels [0][0] != '$';
+    if (node->rest && wildcard)
+        matched += s_items_call (node->rest, fn, arg);
+    if (depth == count) {
+        if (node->items)
+            matched += s_items_call (node->items, fn, arg);
+        return matched;
+    }
+
+    s_edge_t edge = { node, self->levels [depth] };
+    s_node_t *child = (s_node_t *) zhashx_lookup (self->edges, &edge);
+    self->lookups++;
+    if (child)
+        matched += s_match (self, child, depth + 1, count, fn, arg);
+    if (wildcard) {
+        edge.level = "+";
+        self->lookups++;
+        child = (s_node_t *) zhashx_lookup (self->edges, &edge);
+        if (child)
+            matched += s_match (self, child, depth + 1, count, fn, arg);
+    }
+    return matched;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Call fn for item of every pattern matching MQTT topic, patterns starting
+//  with wildcard do not match topics starting with "$". Return number of
+//  matching patterns.
+
+size_t
+zmosq_trie_match (zmosq_trie_t *self, const char *topic, zmosq_trie_match_fn *fn, void *arg)
+{
+    assert (self);
+    assert (topic);
+    if (self->size == 0)
+        return 0;
+    size_t count = s_split (self, topic);
+    if (count == 0)
+        return 0;
+    self->lookups = 0;
+    return s_match (self, &self->root, 0, count, fn, arg);
+}
+
+
+//  --------------------------------------------------------------------------
+//  Return number of patterns in the trie
+
+size_t
+zmosq_trie_size (zmosq_trie_t *self)
+{
+    assert (self);
+    return self->size;
+}
+
+
+//  --------------------------------------------------------------------------
+//  Self test of this class
+
+static void
+s_test_count (void *item, void *arg)
+{
+    (*(int *) arg)++;
+}
+
+//  Return number of edge lookups matching topic takes, with given number of
+//  patterns in the trie
+
+static size_t
+s_test_match_lookups (int patterns)
+{
+    zmosq_trie_t *trie = zmosq_trie_new ();
+    assert (trie);
+    int index;
+    for (index = 0; index < patterns; index++) {
+        char *pattern = zsys_sprintf ("site/%d/+/temp", index);
+        assert (pattern);
+        int r = zmosq_trie_insert (trie, pattern, NULL);
+        assert (r == 0);
+        zstr_free (&pattern);
+    }
+    assert (zmosq_trie_insert (trie, "site/#", NULL) == 0);
+    assert (zmosq_trie_insert (trie, "+/+/room/temp", NULL) == 0);
+    assert (zmosq_trie_insert (trie, "site/42/room/temp", NULL) == 0);
+
+    //  Topic matches site/42/+/temp and the three others
+    assert (zmosq_trie_match (trie, "site/42/room/temp", NULL, NULL) == 4);
+    size_t lookups = trie->lookups;
+    zmosq_trie_destroy (&trie);
+    return lookups;
+}
+
+void
+zmosq_trie_test (bool verbose)
+{
+    printf (" * zmosq_trie: ");
+
+    //  @selftest
+    zmosq_trie_t *trie = zmosq_trie_new ();
+    assert (trie);
+    assert (zmosq_trie_match (trie, "a/b", s_test_count, NULL) == 0);
+
+    assert (zmosq_trie_insert (trie, "", NULL) == -1);
+    assert (zmosq_trie_insert (trie, "a/#/b", NULL) == -1);
+    assert (zmosq_trie_insert (trie, "a/b#", NULL) == -1);
+    assert (zmosq_trie_insert (trie, "a+/b", NULL) == -1);
+    assert (zmosq_trie_size (trie) == 0);
+
+    int items [7];
+    assert (zmosq_trie_insert (trie, "a/b", &items [0]) == 0);
+    assert (zmosq_trie_insert (trie, "a/+", &items [1]) == 0);
+    assert (zmosq_trie_insert (trie, "a/#", &items [2]) == 0);
+    assert (zmosq_trie_insert (trie, "#", &items [3]) == 0);
+    assert (zmosq_trie_insert (trie, "+/b/c", &items [4]) == 0);
+    assert (zmosq_trie_insert (trie, "$SYS/#", &items [5]) == 0);
+    assert (zmosq_trie_insert (trie, "a/b", &items [6]) == 0);
+    assert (zmosq_trie_size (trie) == 7);
+
+    int count = 0;
+    assert (zmosq_trie_match (trie, "a/b", s_test_count, &count) == 5);
+    assert (count == 5);
+    assert (zmosq_trie_match (trie, "a", NULL, NULL) == 2);
+    assert (zmosq_trie_match (trie, "a/c", NULL, NULL) == 3);
+    assert (zmosq_trie_match (trie, "a/b/c", NULL, NULL) == 3);
+    assert (zmosq_trie_match (trie, "x/b/c", NULL, NULL) == 2);
+    assert (zmosq_trie_match (trie, "x/y", NULL, NULL) == 1);
+    //  Wildcards at first level do not match $ topics
+    assert (zmosq_trie_match (trie, "$SYS/load", NULL, NULL) == 1);
+    assert (zmosq_trie_match (trie, "$SYS/b/c", NULL, NULL) == 1);
+    zmosq_trie_destroy (&trie);
+
+    //  Match does not walk patterns, 100 times more of them take the same
+    //  lookups, two for every node on the way
+    size_t lookups = s_test_match_lookups (100);
+    assert (lookups == 16);
+    assert (s_test_match_lookups (10000) == lookups);
+    //  @end
+
+    printf ("OK\n");
+}
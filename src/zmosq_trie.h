@@ -0,0 +1,57 @@
+/*  =========================================================================
+    zmosq_trie - Matcher of MQTT topics against wildcard patterns
+
+    Copyright (c) the Contributors as noted in the AUTHORS file.       
+    This file is part of the Malamute Project.                         
+                                                                       
+    This Source Code Form is subject to the terms of the Mozilla Public
+    License, v. 2.0. If a copy of the MPL was not distributed with this
+    file, You can obtain one at http://mozilla.org/MPL/2.0/.           
+    =========================================================================
+*/
+
+#ifndef ZMOSQ_TRIE_H_INCLUDED
+#define ZMOSQ_TRIE_H_INCLUDED
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//  @interface
+//  Called for item of every pattern matching the topic
+typedef void (zmosq_trie_match_fn) (void *item, void *arg);
+
+//  Create a new empty trie
+ZMSQ_PRIVATE zmosq_trie_t *
+    zmosq_trie_new (void);
+
+//  Destroy the trie, items are not touched
+ZMSQ_PRIVATE void
+    zmosq_trie_destroy (zmosq_trie_t **self_p);
+
+//  Add item for MQTT subscription pattern, "+" matches one level and "#"
+//  as the last level matches any number of levels. Return 0 if OK, -1 if
+//  the pattern is not valid.
+ZMSQ_PRIVATE int
+    zmosq_trie_insert (zmosq_trie_t *self, const char *pattern, void *item);
+
+//  Call fn for item of every pattern matching MQTT topic, patterns starting
+//  with wildcard do not match topics starting with "$". Return number of
+//  matching patterns.
+ZMSQ_PRIVATE size_t
+    zmosq_trie_match (zmosq_trie_t *self, const char *topic, zmosq_trie_match_fn *fn, void *arg);
+
+//  Return number of patterns in the trie
+ZMSQ_PRIVATE size_t
+    zmosq_trie_size (zmosq_trie_t *self);
+
+//  Self test of this class
+ZMSQ_PRIVATE void
+    zmosq_trie_test (bool verbose);
+//  @end
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -24,10 +24,33 @@
 #include "../include/zmosq.h"
 
 //  Extra headers
+#if defined (HAVE_MALAMUTE)
+#include <malamute.h>
+#endif
 
 //  Opaque class structures to allow forward references
+#ifndef ZMOSQ_BROKER_T_DEFINED
+typedef struct _zmosq_broker_t zmosq_broker_t;
+#define ZMOSQ_BROKER_T_DEFINED
+#endif
+#ifndef ZMOSQ_RING_T_DEFINED
+typedef struct _zmosq_ring_t zmosq_ring_t;
+#define ZMOSQ_RING_T_DEFINED
+#endif
+#ifndef ZMOSQ_REACTOR_T_DEFINED
+typedef struct _zmosq_reactor_t zmosq_reactor_t;
+#define ZMOSQ_REACTOR_T_DEFINED
+#endif
+#ifndef ZMOSQ_TRIE_T_DEFINED
+typedef struct _zmosq_trie_t zmosq_trie_t;
+#define ZMOSQ_TRIE_T_DEFINED
+#endif
 
 //  Internal API
+#include "zmosq_broker.h"
+#include "zmosq_ring.h"
+#include "zmosq_reactor.h"
+#include "zmosq_trie.h"
 
 //  *** To avoid double-definitions, only define if building without draft ***
 #ifndef ZMSQ_BUILD_DRAFT_API
@@ -28,6 +28,11 @@
 void
 zmsq_private_selftest (bool verbose)
 {
+// Tests for stable private classes:
+    zmosq_broker_test (verbose);
+    zmosq_ring_test (verbose);
+    zmosq_reactor_test (verbose);
+    zmosq_trie_test (verbose);
 }
 /*
 ################################################################################